@@ -11,17 +11,200 @@
  */
 
 #include "userdelfx.h" 
+#include "bpmdelay_pingpong.h"
 
 
 // Defines
 #define NUM_DELAY_DIVISIONS      15       // # of bpm divisions in table
+#ifndef DELAY_LINE_SIZE
+#if PINGPONG_SINGLE_LINE
+#define DELAY_LINE_SIZE          0x80000  // (the single line has to hold two delay times, see PINGPONG_SINGLE_LINE)
+#else
 #define DELAY_LINE_SIZE          0x40000  // Delay line size (*must be a power of 2)
-#define DELAY_LINE_SIZE_MASK     0x3FFFF  // Mask for the delay line size for rollover
+#endif
+#endif
+#define DELAY_LINE_SIZE_MASK     (DELAY_LINE_SIZE - 1)  // Mask for the delay line size for rollover
 #define DELAY_GLIDE_RATE         12000    //  this value must not be lower than 1. larger values = slower glide rates for delay time
 #define MIN_BPM                  56       // failsafe, likely never used
 #define NUM_NOTES_PER_BEAT       4        // The xd/prologue use quarter notes, hence '4'.
+#ifndef SAMPLE_RATE
 #define SAMPLE_RATE              48000    // 48KHz is our fixed sample rate (the const k_samplerate is only listed in the osc_api.h not the fx_api.h)
-
+#endif                                    // (a host build may override this and DELAY_LINE_SIZE via UDEFS in project.mk)
+#define PROCESS_BLOCK_FRAMES     64       // Large buffers are processed in sub-blocks of this many frames (see DELFX_PROCESS)
+#ifndef DELAY_STORAGE
+#define DELAY_STORAGE            FloatStorage  // How samples are stored in the delay lines (FloatStorage or Q15Storage, see below)
+#endif
+#ifndef DELAY_INTERP
+#define DELAY_INTERP             LinearInterp  // How we read between samples in the delay lines (LinearInterp or HermiteInterp)
+#endif
+#ifndef DELAY_ROUTING
+#define DELAY_ROUTING            PingPongRouting  // How the input and repeats go between the delay lines (see Routing policies below)
+#endif
+#define CROSSFEED_AMOUNT         0.3f     // CrossFeedRouting: how much of each repeat goes to the other side (0-0.5)
+#ifndef CONTROL_RATE
+#define CONTROL_RATE             16       // Slow moving things (e.g. the delay time glide) are updated every 16 frames
+#endif
+// Tail tracking - keeps track of how loud what's left in the delay lines is, for getTailLevel() / isTailSilent()
+// (off on the NTS-1 by default, nothing there asks)
+#ifndef TAIL_TRACKING
+#if defined(__arm__)
+#define TAIL_TRACKING            0
+#else
+#define TAIL_TRACKING            1
+#endif
+#endif
+#define TAIL_SLOT_SHIFT          6        // Tail level is tracked in slots of 2^6 = 64 delay line samples
+#define NUM_TAIL_SLOTS           (DELAY_LINE_SIZE >> TAIL_SLOT_SHIFT)
+#define WRITE_PEAKS              (TAIL_TRACKING || ENGINE_COUNTERS)  // Is the level written into the delay lines needed?
+
+// Granular "cloud" mode - the wet signal is made of many short grains read from around the delay time
+// (set GRANULAR_MODE=1 in UDEFS in project.mk to build this variation)
+#ifndef GRANULAR_MODE
+#define GRANULAR_MODE            0
+#endif
+#define MAX_GRAINS               32       // Most grains that can play at once
+#define GRAIN_LENGTH             2048     // Length of a grain in samples (~43ms)
+#define GRAIN_WINDOW_SHIFT       2        // The window table has GRAIN_LENGTH >> 2 entries (one per 4 samples)
+#define GRAIN_WINDOW_SIZE        (GRAIN_LENGTH >> GRAIN_WINDOW_SHIFT)
+#define GRAIN_SPREAD             0.25f    // Grains start up to +/- 25% of the delay time around the delay time
+#define GRAIN_RAND_SEED          0x12345678  // Where the grain positions' random numbers start from (at every DELFX_INIT)
+#ifndef FRAME_CYCLE_BUDGET
+#define FRAME_CYCLE_BUDGET       800      // CPU cycles per frame the whole effect may use, the grains get what the rest of it leaves
+#endif                                    // (measured while running - a very large value = always MAX_GRAINS)
+
+// Shimmer - each repeat is pitch shifted (by default up an octave) as it bounces across
+// (set SHIMMER_MODE=1 in UDEFS in project.mk to build this variation)
+#ifndef SHIMMER_MODE
+#define SHIMMER_MODE             0
+#endif
+#ifndef SHIMMER_SEMITONES
+#define SHIMMER_SEMITONES        12       // Pitch shift interval per repeat, in semitones (+12 = octave up)
+#endif
+#define SHIMMER_BUFFER_SIZE      1024     // Pitch shifter buffer size (*must be a power of 2)
+#define SHIMMER_BUFFER_MASK      (SHIMMER_BUFFER_SIZE - 1)
+#define SHIMMER_WINDOW           1000     // How far the two pitch shifter taps sweep (must be < SHIMMER_BUFFER_SIZE - 1)
+#define SHIMMER_MIX              0.5f     // How much of the feedback is pitch shifted (0-1)
+
+// Lo-fi - each repeat loses bit depth and sample rate as it bounces across
+// (set LOFI_MODE=1 in UDEFS in project.mk to build this variation)
+#ifndef LOFI_MODE
+#define LOFI_MODE                0
+#endif
+#ifndef LOFI_BITS
+#define LOFI_BITS                8        // Bit depth of the repeats (1-31)
+#endif
+#ifndef LOFI_HOLD
+#define LOFI_HOLD                4        // Hold each repeat sample for this many samples (4 = 12KHz)
+#endif
+#define LOFI_CLIP_MAX            0.99999994f // Largest float below 1.0 (see lofiProcess)
+#define LOFI_MASK                ((q31_t)(0xFFFFFFFFu << (32 - LOFI_BITS))) // Keeps the top LOFI_BITS bits of a q31
+
+// Single line topology - in steady state the left delay line only ever holds the right delay line from
+// one delay time earlier (times the depth), so instead of keeping it, read the right line twice as far back.
+// Half the delay line writes. The one line has to be twice as long to reach back two delay times, so it
+// takes the same memory as the two lines did. (set PINGPONG_SINGLE_LINE=1 in UDEFS in project.mk to build this)
+#ifndef PINGPONG_SINGLE_LINE
+#define PINGPONG_SINGLE_LINE     0
+#endif
+#define NUM_DELAY_HISTORY        (DELAY_LINE_SIZE / CONTROL_RATE)  // One delay time (and depth) per control tick, for the whole delay line
+
+// Mid/side feedback - the repeats are fed back as mid (L+R) and side (L-R) with their own depths, so the
+// stereo image of the repeats narrows (side depth < mid depth) or widens (side depth > mid depth) as they go.
+// The depth knob sets the mid depth, the side depth is MIDSIDE_WIDTH times that (a host can change the
+// width while running with setFeedbackWidth()).
+#ifndef MIDSIDE_FEEDBACK
+#define MIDSIDE_FEEDBACK         0
+#endif
+#ifndef MIDSIDE_WIDTH
+#define MIDSIDE_WIDTH            0.5f     // 0 = the repeats end up mono, 1 = plain ping-pong
+#endif
+
+// Preset bank - a host can store knob settings in up to NUM_PRESETS slots with loadPreset(), and switch
+// between them with selectPreset() (at the start of the next buffer, with nothing to work out then)
+// (off on the NTS-1 by default, nothing there can load or select one)
+#ifndef PRESET_BANK
+#if defined(__arm__)
+#define PRESET_BANK              0
+#else
+#define PRESET_BANK              1
+#endif
+#endif
+#ifndef NUM_PRESETS
+#define NUM_PRESETS              16
+#endif
+
+// Runtime counters / level meters, that a host (or debugger) can read with getCounters()
+// (off on the NTS-1 by default, nothing there reads them and the meters cost cpu time every sample)
+#ifndef ENGINE_COUNTERS
+#if defined(__arm__)
+#define ENGINE_COUNTERS          0
+#else
+#define ENGINE_COUNTERS          1
+#endif
+#endif
+
+// Trace - keeps a record of the last TRACE_LENGTH buffers (bpm, delay time, knobs, cpu time, levels)
+// that a host can read with getTrace(), or a debugger can read straight out of traceRing[].
+#ifndef ENGINE_TRACE
+#define ENGINE_TRACE             0
+#endif
+#ifndef TRACE_LENGTH
+#define TRACE_LENGTH             4096     // *must be a power of 2 (4096 buffers of 16 frames = ~1.4 seconds)
+#endif
+#define TRACE_MASK               (TRACE_LENGTH - 1)
+
+// Denormal guard - flushes tiny (< DENORMAL_LEVEL) feedback to zero, as the repeats die away the feedback
+// would otherwise end up as denormal floats which are very slow on a pc. (The NTS-1's FPU doesn't care.)
+#ifndef DENORMAL_GUARD
+#if defined(__arm__)
+#define DENORMAL_GUARD           0
+#else
+#define DENORMAL_GUARD           1
+#endif
+#endif
+#define DENORMAL_LEVEL           1e-20f   // ~ -400dB
+
+// Lock the delay lines (and the other big buffers) into RAM in DELFX_INIT, so they are never paged out (or
+// paged in for the first time) while the audio is running. Only means anything on a pc (the NTS-1 has no paging).
+#ifndef LOCK_DELAY_MEMORY
+#if defined(__linux__) || defined(__APPLE__)
+#define LOCK_DELAY_MEMORY        1
+#else
+#define LOCK_DELAY_MEMORY        0
+#endif
+#endif
+#if LOCK_DELAY_MEMORY
+#include <sys/mman.h>
+#endif
+
+// Tempo detection - when there is no tempo clock (fx_get_bpmf() gives us nothing), estimate the tempo
+// from the input audio instead. (set TEMPO_DETECT=1 in UDEFS in project.mk to build this in)
+#ifndef TEMPO_DETECT
+#define TEMPO_DETECT             0
+#endif
+#define TEMPO_MAX_BPM            240      // Fastest tempo we look for (MIN_BPM is the slowest)
+#define TEMPO_DECIMATION         256      // The onset envelope is calculated every 256 samples (187.5Hz)
+#define TEMPO_HISTORY            256      // # of onset envelope values kept (*must be a power of 2, and more than TEMPO_MAX_LAG)
+#define TEMPO_MIN_LAG            (SAMPLE_RATE * 60 / (TEMPO_DECIMATION * TEMPO_MAX_BPM))  // Shortest beat (in envelope values)
+#define TEMPO_MAX_LAG            (SAMPLE_RATE * 60 / (TEMPO_DECIMATION * MIN_BPM) + 1)    // Longest beat
+#define TEMPO_NUM_LAGS           (TEMPO_MAX_LAG - TEMPO_MIN_LAG + 1)
+#define TEMPO_LAGS_PER_BLOCK     16       // Autocorrelation lags updated per sub-block, spreads the work out
+#define TEMPO_DECAY              0.9993f  // How quickly the autocorrelation forgets (~8 seconds)
+#define TEMPO_CONFIDENCE         0.5f     // Only use a detected tempo when we're at least this sure of it (0-1)
+
+
+// Sanity checks on the above - the mask trick only works for a power of 2, and the longest delay we can
+// ever be asked for (a whole note at the slowest tempo) has to fit in the delay line at this sample rate.
+static_assert((DELAY_LINE_SIZE & DELAY_LINE_SIZE_MASK) == 0, "DELAY_LINE_SIZE must be a power of 2");
+static_assert((SAMPLE_RATE * 60 / MIN_BPM) * NUM_NOTES_PER_BEAT < DELAY_LINE_SIZE, "DELAY_LINE_SIZE is too small for SAMPLE_RATE");
+static_assert(CONTROL_RATE > 0, "CONTROL_RATE must be at least 1");
+static_assert(!PINGPONG_SINGLE_LINE || (2 * (SAMPLE_RATE * 60 / MIN_BPM) * NUM_NOTES_PER_BEAT + CONTROL_RATE < DELAY_LINE_SIZE), "PINGPONG_SINGLE_LINE needs DELAY_LINE_SIZE to hold two of the longest delay");
+static_assert(!PINGPONG_SINGLE_LINE || ((CONTROL_RATE & (CONTROL_RATE - 1)) == 0), "PINGPONG_SINGLE_LINE needs CONTROL_RATE to be a power of 2");
+static_assert(!PINGPONG_SINGLE_LINE || !(GRANULAR_MODE || SHIMMER_MODE || LOFI_MODE), "PINGPONG_SINGLE_LINE can't be combined with modes that read the left line or process the feedback");
+static_assert(!PINGPONG_SINGLE_LINE || !MIDSIDE_FEEDBACK, "PINGPONG_SINGLE_LINE can't be combined with MIDSIDE_FEEDBACK, the left side is no longer just the right side delayed");
+static_assert(!ENGINE_TRACE || ENGINE_COUNTERS, "ENGINE_TRACE needs the level meters from ENGINE_COUNTERS");
+static_assert((TRACE_LENGTH & TRACE_MASK) == 0, "TRACE_LENGTH must be a power of 2");
+static_assert(!TEMPO_DETECT || (TEMPO_MAX_LAG < TEMPO_HISTORY), "TEMPO_HISTORY is too small for MIN_BPM at this SAMPLE_RATE");
 
 #define PSEUDO_STEREO_OFFSET (float)SAMPLE_RATE * .01f    // How much time to offset the right channel in seconds for pseudo stereo(.01 = 10ms) 
 
@@ -30,9 +213,133 @@
 float delayDivisions[NUM_DELAY_DIVISIONS] = 
 {0.015625,.02083333,.03125,.04166666,.0625f,.08333333f,.125f,.16666667f,.1875f,.25f,.33333333f,.375f,.5f,.75f,1};
 
+////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Delay line policies
+//
+// These are picked at build time (DELAY_STORAGE / DELAY_INTERP) and the sample loop is built
+// for that combination only - there is no checking of which one is in use while running.
+////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Storage: how a sample is kept in the delay lines
+// - FloatStorage: 32 bit float, as it comes in
+struct FloatStorage
+{
+   typedef float sample_t;
+
+   static inline __attribute__((always_inline)) float load(const sample_t s) { return s; }
+   static inline __attribute__((always_inline)) sample_t store(const float f) { return f; }
+};
+
+// - Q15Storage: 16 bit fixed point - half the memory (and memory traffic) of float
+//   (clipped to +/-1, which the feedback never goes past unless the input is already clipping)
+struct Q15Storage
+{
+   typedef q15_t sample_t;
+
+   static inline __attribute__((always_inline)) float load(const sample_t s) { return q15_to_f32(s); }
+   static inline __attribute__((always_inline)) sample_t store(const float f) { return f32_to_q15(clipminmaxf(-1.0f, f, 1.0f)); }
+};
+
+// Interpolation: how we read 'between' two samples in the delay lines
+// - LinearInterp: straight line between the two nearest samples (same as readFrac)
+struct LinearInterp
+{
+   template <class Storage>
+   static inline __attribute__((optimize("Ofast"),always_inline))
+   float read(const float pos, const typename Storage::sample_t *pDelayLine, const uint32_t mask)
+   {
+      const uint32_t base = (uint32_t)pos;
+      const float frac = pos - base;
+      const float s0 = Storage::load(pDelayLine[base & mask]);
+      const float s1 = Storage::load(pDelayLine[(base + 1) & mask]);
+      return linintf(frac, s0, s1);
+   }
+};
+
+// - HermiteInterp: 4 point (cubic) hermite curve through the nearest four samples. Costs two more reads
+//   per sample, but doesn't dull the high end of the repeats while the delay time is gliding.
+struct HermiteInterp
+{
+   template <class Storage>
+   static inline __attribute__((optimize("Ofast"),always_inline))
+   float read(const float pos, const typename Storage::sample_t *pDelayLine, const uint32_t mask)
+   {
+      const uint32_t base = (uint32_t)pos;
+      const float frac = pos - base;
+      const float sm1 = Storage::load(pDelayLine[(base - 1) & mask]);
+      const float s0 = Storage::load(pDelayLine[base & mask]);
+      const float s1 = Storage::load(pDelayLine[(base + 1) & mask]);
+      const float s2 = Storage::load(pDelayLine[(base + 2) & mask]);
+
+      const float c1 = 0.5f * (s1 - sm1);
+      const float c2 = sm1 - 2.5f * s0 + 2.0f * s1 - 0.5f * s2;
+      const float c3 = 0.5f * (s2 - sm1) + 1.5f * (s0 - s1);
+      return ((c3 * frac + c2) * frac + c1) * frac + s0;
+   }
+};
+
+// The ones this build uses
+typedef DELAY_STORAGE DelayStorage;
+typedef DELAY_INTERP DelayInterp;
+typedef DelayStorage::sample_t delay_sample_t;
+
+// Description of what this build was built with (e.g. "FloatStorage/LinearInterp/PingPongRouting+shimmer")
+#define STRINGIFY2(x) #x
+#define STRINGIFY(x) STRINGIFY2(x)
+#if GRANULAR_MODE
+#define VARIANT_GRANULAR "+cloud"
+#else
+#define VARIANT_GRANULAR ""
+#endif
+#if SHIMMER_MODE
+#define VARIANT_SHIMMER "+shimmer"
+#else
+#define VARIANT_SHIMMER ""
+#endif
+#if LOFI_MODE
+#define VARIANT_LOFI "+lofi"
+#else
+#define VARIANT_LOFI ""
+#endif
+#if MIDSIDE_FEEDBACK
+#define VARIANT_MIDSIDE "+midside"
+#else
+#define VARIANT_MIDSIDE ""
+#endif
+#if PINGPONG_SINGLE_LINE
+#define VARIANT_SINGLE "+single"
+#else
+#define VARIANT_SINGLE ""
+#endif
+#if TEMPO_DETECT
+#define VARIANT_TEMPO "+tempo"
+#else
+#define VARIANT_TEMPO ""
+#endif
+const char kernelVariant[] = STRINGIFY(DELAY_STORAGE) "/" STRINGIFY(DELAY_INTERP) "/" STRINGIFY(DELAY_ROUTING) VARIANT_GRANULAR VARIANT_SHIMMER VARIANT_LOFI VARIANT_TEMPO VARIANT_SINGLE VARIANT_MIDSIDE;
+
 // Delay lines for left / right channel
-__sdram float delayLine_L[DELAY_LINE_SIZE];
-__sdram float delayLine_R[DELAY_LINE_SIZE];
+#if !PINGPONG_SINGLE_LINE
+__sdram delay_sample_t delayLine_L[DELAY_LINE_SIZE];
+#endif
+__sdram delay_sample_t delayLine_R[DELAY_LINE_SIZE];
+
+#if PINGPONG_SINGLE_LINE
+// The delay time at every control tick, going back the length of the delay line. The second read
+// has to go back by the delay time *as it was* one delay time ago, or glides would sound different.
+__sdram float delayTimeHistory[NUM_DELAY_HISTORY];
+
+// The depth at every control tick, the same way. The left side is what was written into the left delay
+// line back then, so it has to be at the depth as it was then - turning the knob mustn't change repeats
+// that are already on their way. (The depth only changes between buffers, which on the NTS-1 are always
+// a control tick long. A host with other buffer sizes may see a depth change up to CONTROL_RATE - 1
+// frames late on the left side.)
+__sdram float depthHistory[NUM_DELAY_HISTORY];
+
+// How many frames since the delay time or depth last changed. Once that is longer than the second read
+// goes back, they were the same back then as now and we don't need the history.
+uint32_t framesSinceChange = 0;
+#endif
 
 // Current position in the delay line we are writing to:
 // (integer value as it is per-sample)
@@ -40,25 +347,463 @@ uint32_t delayLine_Wr = 0;
 
 // Smoothing (glide) for delay time:
 // This is the current delay time as we smooth it
-float currentDelayTime = 48000; 
+float currentDelayTime = SAMPLE_RATE; 
 
 // This is the delay time we actually wish to set to
-float targetDelayTime = 48000;
+float targetDelayTime = SAMPLE_RATE;
+
+// How much the delay time changes per sample until the next control tick,
+// and where it will be at that tick
+float delayTimeInc = 0;
+float delayTimeNext = SAMPLE_RATE;
+
+// How much of the distance to the target delay time is left after one control tick's worth of glide
+// (calculated from DELAY_GLIDE_RATE)
+float glideCoeff = 1;
+
+// Frames left until the next control tick
+uint32_t controlFramesLeft = 0;
 
 // Depth knob value from 0-1
 float valDepth = 0;
 
+#if MIDSIDE_FEEDBACK
+// Side depth, as a multiple of the depth knob (mid depth)
+float feedbackWidth = MIDSIDE_WIDTH;
+
+// The width asked for by setFeedbackWidth(), and the handover of it to DELFX_PROCESS at the start of the
+// next buffer (the same way as presets - NULL once it's been picked up). fbCross and fbSame are only ever
+// changed together by the audio code, so it never sees one new and one old.
+float requestedWidth = MIDSIDE_WIDTH;
+float * volatile pendingWidth = NULL;
+
+// The mid/side depths worked out as how much of the other side / the same side is fed back
+// into each delay line (calculated in updateMidSide)
+float fbCross = 0;
+float fbSame = 0;
+#endif
+
 // Time value knob from 0-1
 float valTime = 0;
 
 // Delay time multiplier (will be pulled from delayDivisions table)
 float multiplier = 1;
 
+// The delay time (in samples) is this / the bpm. Worked out from the multiplier when the time knob
+// changes, so there is only the one divide left to do per buffer.
+float delayFactor = SAMPLE_RATE * 60 * NUM_NOTES_PER_BEAT;
+
+// Mix knob value from 0-1
+float valMix = 0.5f;
+
 // Wet/Dry signal levels
 float wet = .5;
 float dry = .5;
 
+#if PRESET_BANK
+// A preset: the knob values, and everything worked out from them
+typedef struct
+{
+   float valTime;
+   float valDepth;
+   float valMix;
+   float multiplier;
+   float delayFactor;
+   float wet;
+   float dry;
+#if MIDSIDE_FEEDBACK
+   float feedbackWidth;
+   float fbCross;
+   float fbSame;
+#endif
+} preset_t;
+
+// The preset bank (filled in by loadPreset)
+preset_t presetBank[NUM_PRESETS];
+
+// The preset to switch to at the start of the next buffer (set by selectPreset, NULL once it's been switched to)
+preset_t * volatile pendingPreset = NULL;
+#endif
+
+#if TAIL_TRACKING
+// Tail tracking:
+// The peak level written into the delay lines, per slot of 64 delay line samples. The slots
+// covering the last delay time worth of writes tell us how loud the tail still is.
+__sdram float tailSlotPeak[NUM_TAIL_SLOTS];
+
+// The slot we most recently wrote a peak into
+uint32_t tailCurrentSlot = 0;
+#endif
+
+// Did all of the big buffers get locked into RAM (LOCK_DELAY_MEMORY)?
+bool memoryLocked = false;
+
+#if ENGINE_COUNTERS
+// Counters as they are being counted (only ever touched by the audio code)
+counters_t countersLive;
+
+// The last copy of them handed over to getCounters(), once per buffer. countersSeq is odd while that copy
+// is being written, so a reader can tell it has to try again (a 'seqlock' - nobody ever waits on a lock).
+counters_t countersPublished;
+volatile uint32_t countersSeq = 0;
+
+// Set by resetCounterPeaks(), the peaks are cleared at the end of the next buffer
+volatile uint32_t countersResetPeaks = 0;
+#endif
+
+#if ENGINE_TRACE
+// The last TRACE_LENGTH buffers, oldest overwritten first. Entry n is in traceRing[n & TRACE_MASK].
+__sdram trace_entry_t traceRing[TRACE_LENGTH];
+
+// # of entries ever written (the next one goes in traceRing[traceWr & TRACE_MASK])
+volatile uint32_t traceWr = 0;
+
+// Level peaks of the buffer being processed
+float tracePeakIn = 0;
+float tracePeakOut = 0;
+#endif
+
+#if GRANULAR_MODE
+// A single grain:
+typedef struct
+{
+   uint32_t pos;     // Where in the delay line this grain is reading (moves 1 sample per frame, same as the write index)
+   uint32_t age;     // How many samples this grain has played so far (0 to GRAIN_LENGTH)
+   uint32_t channel; // Which side it plays on (0 = left, 1 = right), and for most routings which delay line it reads from
+} grain_t;
+
+// The grains currently playing. This is kept sorted by how far behind the write index they read,
+// so that rendering them walks through the delay lines in order.
+grain_t grains[MAX_GRAINS];
+uint32_t numGrains = 0;
+
+// Window (envelope) shared by all grains
+float grainWindow[GRAIN_WINDOW_SIZE];
+
+// How many grains we can afford to play at once - adjusted from the measured cost of a grain
+// and the headroom the rest of the effect leaves in FRAME_CYCLE_BUDGET
+uint32_t grainLimit = MAX_GRAINS;
+
+// Measured cost of a grain, in cycles per frame (smoothed)
+float grainCost = 0;
+
+// Measured cost of everything but the grains, in cycles per frame (smoothed)
+float restCost = 0;
+
+// Cycles the grains took in the sub-block being processed
+uint32_t grainCycles = 0;
+
+// Frames left until the next grain starts
+int32_t grainSpawnCount = 0;
+
+// Random number state for picking grain positions
+uint32_t grainRandState = GRAIN_RAND_SEED;
+#endif
+
+#if SHIMMER_MODE
+// A two tap pitch shifter:
+// Two read taps sweep through a short delay line faster (or slower) than it is written, half a sweep
+// apart. Each tap is faded out as it wraps around, and the other is then at full level.
+typedef struct
+{
+   float buffer[SHIMMER_BUFFER_SIZE];
+   uint32_t wr;    // Write index
+   float phase;    // Sweep position of the first tap (0-1), the second tap is at phase + 0.5
+} shimmer_t;
+
+// One pitch shifter for each direction the feedback crosses over
+shimmer_t shimmer_L;
+shimmer_t shimmer_R;
+
+// How far the taps sweep per sample (calculated from SHIMMER_SEMITONES)
+float shimmerPhaseInc = 0;
+#endif
+
+#if TEMPO_DETECT
+// Onset envelope history (how much louder the input got, every TEMPO_DECIMATION samples)
+float tempoOnsets[TEMPO_HISTORY];
+uint32_t tempoOnsetWr = 0;
+
+// Running (leaky) autocorrelation of the onset envelope, for every beat length we're looking for,
+// and for lag 0 (the onset energy, which the others are compared to for the confidence)
+float tempoAcf[TEMPO_NUM_LAGS];
+float tempoAcf0 = 0;
+
+// Input level being summed up for the next envelope value
+float tempoEnvSum = 0;
+uint32_t tempoEnvFrames = 0;
+float tempoPrevEnv = 0;
+
+// Next lag to update for the latest envelope value (TEMPO_NUM_LAGS = all done)
+uint32_t tempoLagCursor = TEMPO_NUM_LAGS;
+
+// The detected tempo (0 = none yet) and how confident we were in it (0-1)
+float detectedBpm = 0;
+float detectedConfidence = 0;
+#endif
+
+#if LOFI_MODE
+// Sample and hold state for the lo-fi stage
+typedef struct
+{
+   uint32_t count; // Samples left until we take a new sample
+   float held;     // The (bit reduced) sample being held
+} lofi_t;
+
+// One for each direction the feedback crosses over
+lofi_t lofi_L;
+lofi_t lofi_R;
+#endif
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Routing policies
+//
+// Where the input and the repeats (the delayed signals, after any processing) are written. Picked at
+// build time (DELAY_ROUTING) like the delay line policies, so each one gets its own sample loop.
+// route() gives what to write into each delay line, and (backL / backR) how much of that is the repeats
+// being fed back - for the feedback level meter.
+////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// - PingPongRouting: the right input goes into the right delay line, and the repeats swap sides
+//   every time around (the original, and default)
+struct PingPongRouting
+{
+   static const bool pingPong = true;
+   static const uint32_t rightOffset = 0;
+
+   static inline __attribute__((always_inline))
+   void route(const float sigInL, const float sigInR, const float feedbackL, const float feedbackR, float &writeL, float &writeR, float &backL, float &backR)
+   {
+      (void)sigInL;
+#if MIDSIDE_FEEDBACK
+      // Mid/side feedback: the mid and side depths are already folded into a cross (other side) and
+      // a same side amount in DELFX_PARAM, so this is still just the ping-pong cross-feed, plus a bit
+      // of each side fed back into itself.
+      backL = feedbackR * fbCross + feedbackL * fbSame;
+      backR = feedbackL * fbCross + feedbackR * fbSame;
+#else
+      // Store the delayed right channel signal - multiplied by the feedback value (0-1) into the left channel
+      backL = feedbackR * valDepth; //tbd on the valdepth
+      backR = feedbackL * valDepth;
+#endif
+      writeL = backL;
+
+      // Write the right channel input signal into the right channel buffer, *added* (mixed) with this
+      // left delayed signal (multiplied by feedback)
+      // - that is, effectively mix this left delayed signal with the right input signal 
+      writeR = sigInR + backR;
+   }
+};
+
+// - DualMonoRouting: two separate mono delays, each side repeats only itself (this is also plain linked
+//   stereo - both sides always share the one delay time and depth)
+struct DualMonoRouting
+{
+   static const bool pingPong = false;
+   static const uint32_t rightOffset = 0;
+
+   static inline __attribute__((always_inline))
+   void route(const float sigInL, const float sigInR, const float feedbackL, const float feedbackR, float &writeL, float &writeR, float &backL, float &backR)
+   {
+      backL = feedbackL * valDepth;
+      backR = feedbackR * valDepth;
+      writeL = sigInL + backL;
+      writeR = sigInR + backR;
+   }
+};
+
+// - PseudoStereoRouting: the input (mixed to mono) goes into both delay lines, each side repeats itself,
+//   and the right side is read PSEUDO_STEREO_OFFSET later to give the repeats some width
+struct PseudoStereoRouting
+{
+   static const bool pingPong = false;
+   static const uint32_t rightOffset = (uint32_t)(PSEUDO_STEREO_OFFSET);
+
+   static inline __attribute__((always_inline))
+   void route(const float sigInL, const float sigInR, const float feedbackL, const float feedbackR, float &writeL, float &writeR, float &backL, float &backR)
+   {
+      const float mono = 0.5f * (sigInL + sigInR);
+      backL = feedbackL * valDepth;
+      backR = feedbackR * valDepth;
+      writeL = mono + backL;
+      writeR = mono + backR;
+   }
+};
+
+// - CrossFeedRouting: each side repeats itself, with CROSSFEED_AMOUNT of each repeat going to the other side
+struct CrossFeedRouting
+{
+   static const bool pingPong = false;
+   static const uint32_t rightOffset = 0;
+
+   static inline __attribute__((always_inline))
+   void route(const float sigInL, const float sigInR, const float feedbackL, const float feedbackR, float &writeL, float &writeR, float &backL, float &backR)
+   {
+      backL = valDepth * (feedbackL + CROSSFEED_AMOUNT * (feedbackR - feedbackL));
+      backR = valDepth * (feedbackR + CROSSFEED_AMOUNT * (feedbackL - feedbackR));
+      writeL = sigInL + backL;
+      writeR = sigInR + backR;
+   }
+};
+
+// The one this build uses
+typedef DELAY_ROUTING DelayRouting;
+
+static_assert(DelayRouting::pingPong || !PINGPONG_SINGLE_LINE, "PINGPONG_SINGLE_LINE only works with PingPongRouting");
+static_assert(DelayRouting::pingPong || !MIDSIDE_FEEDBACK, "MIDSIDE_FEEDBACK only works with PingPongRouting");
+static_assert(DelayRouting::rightOffset + (SAMPLE_RATE * 60 / MIN_BPM) * NUM_NOTES_PER_BEAT < DELAY_LINE_SIZE, "DELAY_LINE_SIZE is too small for the routing's right side offset");
+
  
+////////////////////////////////////////////////////////////////////////
+// readCycleCounter
+// - Free running cpu cycle counter, used to measure how long things take
+//   (the DWT cycle counter on the NTS-1, the time stamp counter on a pc)
+////////////////////////////////////////////////////////////////////////
+inline __attribute__((always_inline))
+uint32_t readCycleCounter()
+{
+#if defined(__arm__)
+   return *(volatile uint32_t *)0xE0001004; // DWT->CYCCNT
+#elif defined(__i386__) || defined(__x86_64__)
+   return (uint32_t)__builtin_ia32_rdtsc();
+#else
+   return 0; // No counter, anything that depends on this will assume there is always time to spare
+#endif
+}
+
+
+#if MIDSIDE_FEEDBACK
+////////////////////////////////////////////////////////////////////////
+// midSideAmounts
+// - Work out the feedback amounts for a depth (the mid depth) and
+//   width (side depth as a multiple of the mid depth)
+////////////////////////////////////////////////////////////////////////
+void midSideAmounts(const float depth, const float width, float *pCross, float *pSame)
+{
+   // Mid = (L+R)/2, side = (L-R)/2, each multiplied by its depth, then back to L = mid+side, R = mid-side.
+   // Multiplied out, each side gets (mid+side)/2 of the other side (the ping-pong) and (mid-side)/2
+   // of itself. With side = mid this is the plain ping-pong (fbSame = 0).
+   const float midDepth = depth;
+   float sideDepth = depth * width;
+
+   // Never more than full feedback, or the side would keep getting louder
+   sideDepth = (sideDepth > 1.0f) ? 1.0f : sideDepth;
+
+   *pCross = 0.5f * (midDepth + sideDepth);
+   *pSame = 0.5f * (midDepth - sideDepth);
+}
+
+
+////////////////////////////////////////////////////////////////////////
+// updateMidSide
+// - Work out the feedback amounts from the depth knob and width
+////////////////////////////////////////////////////////////////////////
+void updateMidSide()
+{
+   midSideAmounts(valDepth, feedbackWidth, &fbCross, &fbSame);
+}
+#endif
+
+
+////////////////////////////////////////////////////////////////////////
+// timeKnobToMultiplier
+// - The delay time multiplier for a time knob value (0-1)
+////////////////////////////////////////////////////////////////////////
+float timeKnobToMultiplier(const float valf)
+{
+   // Convert the 0-1 value into an array index (e.g. there are 15 divisions, so we need an index value from 0-14)         
+   float f = valf;
+   f *= NUM_DELAY_DIVISIONS - 1; //0-14 15 delay divisions
+
+   // Set an integer value for our table index
+   int divIndex = (int)f;
+   
+   // Failsafe, ensure it is within a valid range (it always is though)
+   if ((divIndex >= NUM_DELAY_DIVISIONS) || (divIndex < 0))
+   {
+      divIndex = NUM_DELAY_DIVISIONS - 1;//failsafe
+   }
+
+   // Get the time multiplier from the division table.
+   return delayDivisions[divIndex];
+}
+
+
+////////////////////////////////////////////////////////////////////////
+// mixKnobToWet
+// - The wet level for a mix knob value (0-1), the dry level is 1 - this
+////////////////////////////////////////////////////////////////////////
+float mixKnobToWet(const float valf)
+{
+   float s_mix; // Used for wet/dry calculations
+
+   //Left side of the knob (all dry to full mix)
+   // Adapted from the korg example, this allows us to get a 50/50 split at full mix but a higher level for
+   // full wet / full dry. 
+
+   // I've expanded the korg example here to make it a bit easier to follow
+   //s_mix = (valf <= 0.49f) ? 1.02040816326530612244f * valf : (valf >= 0.51f) ? 0.5f + 1.02f * (valf-0.51f) : 0.5f;    
+   
+   // Are we at the left half of the knob position?
+   if (valf <= 0.49f)
+   {
+      // Yes, amplify the mix value slightly
+      s_mix = 1.02040816326530612244f * valf;
+   }
+   // No, are we at the right half of the knob position?
+   else if (valf >= 0.51f) 
+   {
+      // Yes, amplify the mix value but also invert it and subtract the 0.51 offset from it (so the mix value will decrease when turning the knob higher)
+      s_mix = 0.5f + 1.02f * (valf-0.51f);
+   }
+   else
+   {
+      // Midpoint, set the mix value to 50%
+      s_mix =  0.5f; 
+   }
+   return s_mix;
+}
+
+
+#if PRESET_BANK
+////////////////////////////////////////////////////////////////////////
+// applyPreset
+// - Switch to a preset. Everything in it has already been worked out,
+//   so this is only copying.
+////////////////////////////////////////////////////////////////////////
+inline __attribute__((always_inline))
+void applyPreset(const preset_t *p)
+{
+   valTime = p->valTime;
+   valDepth = p->valDepth;
+   valMix = p->valMix;
+   multiplier = p->multiplier;
+   delayFactor = p->delayFactor;
+   wet = p->wet;
+   dry = p->dry;
+#if MIDSIDE_FEEDBACK
+   feedbackWidth = p->feedbackWidth;
+   fbCross = p->fbCross;
+   fbSame = p->fbSame;
+#endif
+}
+#endif
+
+
+#if LOCK_DELAY_MEMORY
+////////////////////////////////////////////////////////////////////////
+// lockMemory
+// - Keep some memory in RAM (if we're allowed to, otherwise it just
+//   stays where it is - check isMemoryLocked())
+////////////////////////////////////////////////////////////////////////
+void lockMemory(const void *p, size_t size)
+{
+   memoryLocked &= (mlock(p, size) == 0);
+}
+#endif
+
+
 ////////////////////////////////////////////////////////////////////////
 // DELFX_INIT
 // - initialize the effect variables, including clearing the delay lines
@@ -72,21 +817,158 @@ void DELFX_INIT(uint32_t platform, uint32_t api)
    // get either old delay sounds, or very unpleasant noises from a previous effects. 
    for (int i=0;i<DELAY_LINE_SIZE;i++)
    {
+#if !PINGPONG_SINGLE_LINE
       delayLine_L[i] = 0;
+#endif
       delayLine_R[i] = 0;
    }
 
+#if TAIL_TRACKING
+   // The delay lines are now silent, so is the tail
+   for (int i=0;i<NUM_TAIL_SLOTS;i++)
+   {
+      tailSlotPeak[i] = 0;
+   }
+   tailCurrentSlot = 0;
+#endif
+
+#if ENGINE_COUNTERS
+   countersLive = counters_t();
+   countersLive.variant = kernelVariant;
+   countersPublished = countersLive;
+#endif
+
+#if ENGINE_TRACE
+   __atomic_store_n(&traceWr, 0, __ATOMIC_RELEASE);
+
+   // (clearing it also means the audio is never the first to touch it)
+   for (int i=0;i<TRACE_LENGTH;i++)
+   {
+      traceRing[i] = trace_entry_t();
+   }
+#endif
+
+#if defined(__arm__) && (GRANULAR_MODE || ENGINE_TRACE)
+   // Make sure the DWT cycle counter is running (for readCycleCounter, only used by these)
+   *(volatile uint32_t *)0xE000EDFC |= (1 << 24); // CoreDebug->DEMCR |= TRCENA
+   *(volatile uint32_t *)0xE0001000 |= 1;         // DWT->CTRL |= CYCCNTENA
+#endif
+
+#if GRANULAR_MODE
+   // Calculate the grain window. This is (4x(1-x))^2, which is very close to a hann window
+   // but doesn't need any trig functions.
+   for (int i=0;i<GRAIN_WINDOW_SIZE;i++)
+   {
+      const float w = (float)i / GRAIN_WINDOW_SIZE;
+      const float p = 4 * w * (1 - w);
+      grainWindow[i] = p * p;
+   }
+   numGrains = 0;
+   grainLimit = MAX_GRAINS;
+   grainRandState = GRAIN_RAND_SEED; // Same grains every time from here on, for the same input
+   grainCost = 0;
+   restCost = 0;
+   grainCycles = 0;
+   grainSpawnCount = 0;
+#endif
+
+#if SHIMMER_MODE
+   for (int i=0;i<SHIMMER_BUFFER_SIZE;i++)
+   {
+      shimmer_L.buffer[i] = 0;
+      shimmer_R.buffer[i] = 0;
+   }
+   shimmer_L.wr = shimmer_R.wr = 0;
+   shimmer_L.phase = shimmer_R.phase = 0;
+
+   // To play back 'ratio' times faster than we write, the taps have to move (1 - ratio) samples closer
+   // to the write index every sample. (ratio = 2^(semitones/12))
+   shimmerPhaseInc = (1.0f - fastpow2f(SHIMMER_SEMITONES / 12.0f)) / SHIMMER_WINDOW;
+#endif
+
+#if TEMPO_DETECT
+   for (int i=0;i<TEMPO_HISTORY;i++)
+   {
+      tempoOnsets[i] = 0;
+   }
+   for (int i=0;i<TEMPO_NUM_LAGS;i++)
+   {
+      tempoAcf[i] = 0;
+   }
+   tempoOnsetWr = 0;
+   tempoAcf0 = 0;
+   tempoEnvSum = 0;
+   tempoEnvFrames = 0;
+   tempoPrevEnv = 0;
+   tempoLagCursor = TEMPO_NUM_LAGS;
+   detectedBpm = 0;
+   detectedConfidence = 0;
+#endif
+
+#if LOFI_MODE
+   lofi_L.count = lofi_R.count = 0;
+   lofi_L.held = lofi_R.held = 0;
+#endif
+
    
    currentDelayTime = SAMPLE_RATE; 
    targetDelayTime = SAMPLE_RATE;
 
+   // The glide moves 1/DELAY_GLIDE_RATE of the remaining distance every sample, so after a control tick
+   // (1 - 1/DELAY_GLIDE_RATE)^CONTROL_RATE of the distance is left.
+   glideCoeff = 1;
+   for (int i=0;i<CONTROL_RATE;i++)
+   {
+      glideCoeff *= 1.0f - 1.0f / DELAY_GLIDE_RATE;
+   }
+   delayTimeInc = 0;
+   delayTimeNext = currentDelayTime;
+   controlFramesLeft = 0;
+
    valDepth = 0;
+#if PINGPONG_SINGLE_LINE
+   for (int i=0;i<NUM_DELAY_HISTORY;i++)
+   {
+      delayTimeHistory[i] = currentDelayTime;
+      depthHistory[i] = valDepth;
+   }
+   framesSinceChange = 0;
+#endif
+#if MIDSIDE_FEEDBACK
+   feedbackWidth = MIDSIDE_WIDTH;
+   requestedWidth = MIDSIDE_WIDTH;
+   updateMidSide();
+   __atomic_store_n(&pendingWidth, (float *)NULL, __ATOMIC_RELAXED);
+#endif
    valTime = 0;
    multiplier = 1;
+   delayFactor = SAMPLE_RATE * 60 * NUM_NOTES_PER_BEAT;
+   valMix = 0.5f;
+#if PRESET_BANK
+   __atomic_store_n(&pendingPreset, (preset_t *)NULL, __ATOMIC_RELAXED);
+#endif
 
 
    wet = 0.5f;
    dry = 0.5f;
+
+#if LOCK_DELAY_MEMORY
+   // Everything above has now been written at least once, so it is all in RAM. Keep it there.
+   memoryLocked = true;
+#if !PINGPONG_SINGLE_LINE
+   lockMemory(delayLine_L, sizeof(delayLine_L));
+#else
+   lockMemory(delayTimeHistory, sizeof(delayTimeHistory));
+   lockMemory(depthHistory, sizeof(depthHistory));
+#endif
+   lockMemory(delayLine_R, sizeof(delayLine_R));
+#if TAIL_TRACKING
+   lockMemory(tailSlotPeak, sizeof(tailSlotPeak));
+#endif
+#if ENGINE_TRACE
+   lockMemory(traceRing, sizeof(traceRing));
+#endif
+#endif
    
 }
 
@@ -98,13 +980,14 @@ void DELFX_INIT(uint32_t platform, uint32_t api)
 // That is, this allows you to read 'between' two points in a table
 // using a floating point index.
 //  - buffer size must be a power of 2
+//  - mask is the buffer size - 1 (the delay lines by default)
 //
 // this is from the korg example (slightly modified)
 ////////////////////////////////////////////////////////////////////////////////////////////////////////
 // compiler conditions to a: compile this code 'inline' and b: set a specific optimization for this routine.
 // compiling inline saves you a few cycles but can result in larger code.
 inline __attribute__((optimize("Ofast"),always_inline)) 
-float readFrac(const float pos, float *pDelayLine) 
+float readFrac(const float pos, float *pDelayLine, const uint32_t mask = DELAY_LINE_SIZE_MASK) 
 {
    // Get the 'base' value - that is, the integer value of the position
    // e.g. if we're looking for value at position 1423.6, this will yield an integer of 1426
@@ -115,12 +998,12 @@ float readFrac(const float pos, float *pDelayLine)
 
    // Get the sample at the base index - note by masking the base index with the delay line mask we don't have
    // to do any modulus / manual checks for overflow. This requries the buffer size to be a power of 2.
-   const float s0 = pDelayLine[base & DELAY_LINE_SIZE_MASK];
+   const float s0 = pDelayLine[base & mask];
 
    // Get the next sample at the base index + 1. Again, by masking with the delay line size mask, we don't have 
    // to worry about rolling over the buffer index.
    base++;
-   const float s1 = pDelayLine[base & DELAY_LINE_SIZE_MASK];
+   const float s1 = pDelayLine[base & mask];
 
    // Using the logue-sdk linear interpolation function, get the linearly-interpolated result of the two sample values.
    float r = linintf(frac, s0, s1);
@@ -128,11 +1011,770 @@ float readFrac(const float pos, float *pDelayLine)
 }
 
 
+#if SHIMMER_MODE
+////////////////////////////////////////////////////////////////////////
+// shimmerProcess
+// - Pitch shift one sample through a two tap pitch shifter
+////////////////////////////////////////////////////////////////////////
+inline __attribute__((optimize("Ofast"),always_inline))
+float shimmerProcess(shimmer_t *s, const float in)
+{
+   s->buffer[s->wr] = in;
+
+   // The second tap is half a sweep behind the first
+   const float phase1 = s->phase;
+   const float phase2 = (phase1 >= 0.5f) ? phase1 - 0.5f : phase1 + 0.5f;
+
+   // Read both taps behind the write index (+ the buffer size so the position is never negative)
+   const float base = (float)(s->wr + SHIMMER_BUFFER_SIZE);
+   const float tap1 = readFrac(base - phase1 * SHIMMER_WINDOW, s->buffer, SHIMMER_BUFFER_MASK);
+   const float tap2 = readFrac(base - phase2 * SHIMMER_WINDOW, s->buffer, SHIMMER_BUFFER_MASK);
+
+   // Triangle crossfade: each tap is silent as it jumps from one end of the sweep to the other,
+   // and the two gains always add up to 1.
+   const float gain1 = 1.0f - si_fabsf(2.0f * phase1 - 1.0f);
+   const float out = tap2 + gain1 * (tap1 - tap2);
+
+   // Move along
+   s->wr = (s->wr + 1) & SHIMMER_BUFFER_MASK;
+   float phase = phase1 + shimmerPhaseInc;
+   if (phase < 0)
+   {
+      phase += 1.0f;
+   }
+   else if (phase >= 1.0f)
+   {
+      phase -= 1.0f;
+   }
+   s->phase = phase;
+
+   // Mix with the unshifted signal
+   return in + SHIMMER_MIX * (out - in);
+}
+#endif
+
+
+#if LOFI_MODE
+////////////////////////////////////////////////////////////////////////
+// lofiProcess
+// - Reduce the bit depth and sample rate of one sample
+////////////////////////////////////////////////////////////////////////
+inline __attribute__((always_inline))
+float lofiProcess(lofi_t *l, const float in)
+{
+   // Only take a new sample every LOFI_HOLD samples, otherwise keep repeating the last one
+   if (l->count == 0)
+   {
+      // Bit reduction is done on the integer (q31) value - just mask off the low bits.
+      // (clip first, the float to q31 conversion doesn't saturate on every cpu. The top has to be clipped just
+      // below 1.0 - 1.0 * 0x7FFFFFFF rounds to 2^31 as a float, which is one past the largest q31.)
+      const q31_t q = f32_to_q31(clipminmaxf(-1.0f, in, LOFI_CLIP_MAX)) & LOFI_MASK;
+      l->held = q31_to_f32(q);
+      l->count = LOFI_HOLD;
+   }
+   l->count--;
+   return l->held;
+}
+#endif
+
+
  
 
 
 
 
+#if GRANULAR_MODE
+////////////////////////////////////////////////////////////////////////
+// spawnGrain
+// - Start a new grain at a random position around the delay time
+////////////////////////////////////////////////////////////////////////
+void spawnGrain()
+{
+   // xorshift random number generator, cheap and good enough for this
+   grainRandState ^= grainRandState << 13;
+   grainRandState ^= grainRandState >> 17;
+   grainRandState ^= grainRandState << 5;
+
+   // Random value from -1 to 1 (top bits), pick the side it plays on from the lowest bit
+   const float r = (float)(int32_t)grainRandState * (1.0f / 2147483648.0f);
+   const uint32_t channel = grainRandState & 1;
+
+   // How far behind the write index the grain reads. Grains move at the same speed as the write index
+   // so this stays the same for the life of the grain - it must never be so short that the grain would
+   // read something we haven't written yet in this sub-block.
+   float offset = currentDelayTime * (1.0f + r * GRAIN_SPREAD);
+   if (offset < PROCESS_BLOCK_FRAMES + 1)
+   {
+      offset = PROCESS_BLOCK_FRAMES + 1;
+   }
+   if (offset > DELAY_LINE_SIZE - 1)
+   {
+      offset = DELAY_LINE_SIZE - 1;
+   }
+   const uint32_t distance = (uint32_t)offset;
+
+   // Find where this grain goes, keeping the grains sorted by how far behind the write index they are
+   uint32_t i = numGrains;
+   while ((i > 0) && (((delayLine_Wr - grains[i-1].pos) & DELAY_LINE_SIZE_MASK) < distance))
+   {
+      grains[i] = grains[i-1];
+      i--;
+   }
+   grains[i].pos = (delayLine_Wr - distance) & DELAY_LINE_SIZE_MASK;
+   grains[i].age = 0;
+   grains[i].channel = channel;
+   numGrains++;
+}
+
+
+////////////////////////////////////////////////////////////////////////
+// renderGrains
+// - Mix all of the playing grains for the next 'frames' frames into
+//   cloud[channel][frame], start new grains and retire finished ones.
+////////////////////////////////////////////////////////////////////////
+void renderGrains(float cloud[2][PROCESS_BLOCK_FRAMES], uint32_t frames)
+{
+   for (uint32_t i = 0; i < frames; i++)
+   {
+      cloud[0][i] = 0;
+      cloud[1][i] = 0;
+   }
+
+   // Start any grains that are due. Each grain overlaps with grainLimit others at most.
+   grainSpawnCount -= frames;
+   while (grainSpawnCount <= 0)
+   {
+      if (numGrains < grainLimit)
+      {
+         spawnGrain();
+      }
+      grainSpawnCount += GRAIN_LENGTH / grainLimit;
+   }
+
+   const uint32_t startCycles = readCycleCounter();
+
+   // Render the grains one at a time (rather than one frame at a time), in the order they sit in the delay lines.
+   // Each grain is then a short run through the delay line and the window table, and the inner loop is a plain
+   // multiply-accumulate into the cloud buffer that the compiler can vectorize on a pc.
+   uint32_t kept = 0;
+   for (uint32_t g = 0; g < numGrains; g++)
+   {
+      grain_t grain = grains[g];
+
+      // With ping-pong routing the left delay line only holds the repeats crossing over (already times the depth),
+      // while the right one holds the input and every repeat - so all of the grains read that, and are just
+      // panned to either side. (The other routings have the input in both.)
+      const delay_sample_t *pDelayLine = (grain.channel || DelayRouting::pingPong) ? delayLine_R : delayLine_L;
+      float *pCloud = cloud[grain.channel];
+
+      // The grain may finish part way through this block
+      uint32_t n = GRAIN_LENGTH - grain.age;
+      if (n > frames)
+      {
+         n = frames;
+      }
+
+      for (uint32_t i = 0; i < n; i++)
+      {
+         pCloud[i] += grainWindow[(grain.age + i) >> GRAIN_WINDOW_SHIFT] * DelayStorage::load(pDelayLine[(grain.pos + i) & DELAY_LINE_SIZE_MASK]);
+      }
+
+      // Keep this grain if it still has some left to play (this keeps the grains in order too)
+      grain.pos = (grain.pos + frames) & DELAY_LINE_SIZE_MASK;
+      grain.age += n;
+      if (grain.age < GRAIN_LENGTH)
+      {
+         grains[kept++] = grain;
+      }
+   }
+
+   // Measure what the grains cost us, and from that how many we can afford in the headroom the rest of the
+   // effect leaves (restCost is measured by processBlock).
+   grainCycles = readCycleCounter() - startCycles;
+   if (numGrains)
+   {
+      const float cost = (float)grainCycles / (numGrains * frames);
+      grainCost += (cost - grainCost) * 0.05f;
+
+      const float limit = (FRAME_CYCLE_BUDGET - restCost) / (grainCost + 1.0f);
+      grainLimit = (limit >= MAX_GRAINS) ? MAX_GRAINS : (limit < 1) ? 1 : (uint32_t)limit;
+   }
+   numGrains = kept;
+
+   // Scale the cloud so it is roughly the same level no matter how many grains are playing
+   // (the window averages ~0.5, and the grains are mostly unrelated so they add up as the square root)
+   const float gain = 2.0f / sqrtf((float)grainLimit);
+   for (uint32_t i = 0; i < frames; i++)
+   {
+      cloud[0][i] *= gain;
+      cloud[1][i] *= gain;
+   }
+}
+#endif
+
+
+#if TEMPO_DETECT
+////////////////////////////////////////////////////////////////////////
+// tempoPickPeak
+// - Find the beat length from the autocorrelation, and use it if we
+//   are confident enough in it
+////////////////////////////////////////////////////////////////////////
+void tempoPickPeak()
+{
+   // A beat that falls between two lags is split across them, so the strength of a lag is its own
+   // value plus its larger neighbour.
+   float strength[TEMPO_NUM_LAGS];
+   float peak = 0;
+   strength[0] = strength[TEMPO_NUM_LAGS - 1] = 0;
+   for (uint32_t i = 1; i < TEMPO_NUM_LAGS - 1; i++)
+   {
+      const float n = (tempoAcf[i-1] > tempoAcf[i+1]) ? tempoAcf[i-1] : tempoAcf[i+1];
+      strength[i] = tempoAcf[i] + n;
+      peak = (strength[i] > peak) ? strength[i] : peak;
+   }
+   if ((peak <= 0) || (tempoAcf0 <= 0))
+   {
+      return;
+   }
+
+   // A beat repeats at 2, 3.. beats as well, and those are (nearly) as strong. Take the shortest lag
+   // that is a local maximum and close to the strongest.
+   uint32_t best = 0;
+   for (uint32_t i = 1; i < TEMPO_NUM_LAGS - 1; i++)
+   {
+      if ((strength[i] >= 0.8f * peak) && (tempoAcf[i] >= tempoAcf[i-1]) && (tempoAcf[i] >= tempoAcf[i+1]))
+      {
+         best = i;
+         break;
+      }
+   }
+   if (best == 0)
+   {
+      return; // Peak is at the edge of the range, not a beat we can use
+   }
+
+   // How much of the onset energy repeats at this lag
+   float confidence = strength[best] / tempoAcf0;
+   confidence = (confidence > 1.0f) ? 1.0f : confidence;
+   detectedConfidence = confidence;
+   if (confidence < TEMPO_CONFIDENCE)
+   {
+      return;
+   }
+
+   // Fit a parabola through the peak and its neighbours for a fractional lag, one lag is ~1 bpm at 120bpm
+   const float a = tempoAcf[best-1];
+   const float b = tempoAcf[best];
+   const float c = tempoAcf[best+1];
+   const float d = a - 2 * b + c;
+   const float frac = (d < 0) ? 0.5f * (a - c) / d : 0;
+   const float lag = (float)(best + TEMPO_MIN_LAG) + frac;
+
+   detectedBpm = (60.0f * SAMPLE_RATE / TEMPO_DECIMATION) / lag;
+}
+
+
+////////////////////////////////////////////////////////////////////////
+// tempoUpdateLags
+// - Update up to 'count' autocorrelation lags with the latest onset
+////////////////////////////////////////////////////////////////////////
+void tempoUpdateLags(uint32_t count)
+{
+   if (tempoLagCursor >= TEMPO_NUM_LAGS)
+   {
+      return;
+   }
+
+   const float onset = tempoOnsets[tempoOnsetWr];
+   uint32_t end = tempoLagCursor + count;
+   if (end > TEMPO_NUM_LAGS)
+   {
+      end = TEMPO_NUM_LAGS;
+   }
+   for (uint32_t i = tempoLagCursor; i < end; i++)
+   {
+      const float past = tempoOnsets[(tempoOnsetWr - (i + TEMPO_MIN_LAG)) & (TEMPO_HISTORY - 1)];
+      tempoAcf[i] = tempoAcf[i] * TEMPO_DECAY + onset * past;
+   }
+   tempoLagCursor = end;
+
+   // All lags done, see what tempo they point to
+   if (tempoLagCursor >= TEMPO_NUM_LAGS)
+   {
+      tempoPickPeak();
+   }
+}
+
+
+////////////////////////////////////////////////////////////////////////
+// tempoProcess
+// - Called once per sub-block with the sum of the input level over it
+////////////////////////////////////////////////////////////////////////
+void tempoProcess(float envSum, uint32_t frames)
+{
+   tempoEnvSum += envSum;
+   tempoEnvFrames += frames;
+
+   if (tempoEnvFrames >= TEMPO_DECIMATION)
+   {
+      // Finish off the last envelope value if the sub-blocks were too big to spread it out
+      tempoUpdateLags(TEMPO_NUM_LAGS);
+
+      // The onset is how much louder the (average) input got since last time
+      const float env = tempoEnvSum / tempoEnvFrames;
+      const float onset = (env > tempoPrevEnv) ? env - tempoPrevEnv : 0;
+      tempoPrevEnv = env;
+      tempoEnvSum = 0;
+      tempoEnvFrames = 0;
+
+      tempoOnsetWr = (tempoOnsetWr + 1) & (TEMPO_HISTORY - 1);
+      tempoOnsets[tempoOnsetWr] = onset;
+      tempoAcf0 = tempoAcf0 * TEMPO_DECAY + onset * onset;
+      tempoLagCursor = 0;
+   }
+
+   // A few lags at a time so no one buffer takes the whole hit
+   tempoUpdateLags(TEMPO_LAGS_PER_BLOCK);
+}
+#endif
+
+
+////////////////////////////////////////////////////////////////////////
+// controlTick
+// - Called every CONTROL_RATE frames. Anything that changes slowly is
+//   calculated here, and turned into a per-sample step that the sample
+//   loop just adds on until the next tick.
+////////////////////////////////////////////////////////////////////////
+inline __attribute__((always_inline))
+void controlTick()
+{
+   // Delay time glide:
+   // Land exactly where the last tick said we would be (adding up the per-sample steps drifts a little),
+   // then work out where the (exponential) glide towards the target will be at the next tick, and get
+   // there in a straight line.
+   currentDelayTime = delayTimeNext;
+   delayTimeNext = targetDelayTime + (currentDelayTime - targetDelayTime) * glideCoeff;
+   delayTimeInc = (delayTimeNext - currentDelayTime) * (1.0f / CONTROL_RATE);
+
+#if PINGPONG_SINGLE_LINE
+   // Ticks always land on a multiple of CONTROL_RATE in the delay line, so this slot lines up with the write index
+   const uint32_t tick = delayLine_Wr / CONTROL_RATE;
+   delayTimeHistory[tick & (NUM_DELAY_HISTORY - 1)] = currentDelayTime;
+
+   // A new depth starts the steady count over (see processBlock)
+   framesSinceChange = (valDepth != depthHistory[(tick - 1) & (NUM_DELAY_HISTORY - 1)]) ? 0 : framesSinceChange;
+   depthHistory[tick & (NUM_DELAY_HISTORY - 1)] = valDepth;
+#endif
+
+   controlFramesLeft = CONTROL_RATE;
+}
+
+
+#if PINGPONG_SINGLE_LINE
+////////////////////////////////////////////////////////////////////////
+// delayTimeAt
+// - The delay time that was used when writing position 'pos' of the
+//   delay line. Between ticks the delay time moves in a straight line
+//   (see controlTick), so we can work it out exactly from the history.
+////////////////////////////////////////////////////////////////////////
+inline __attribute__((always_inline))
+float delayTimeAt(const float pos)
+{
+   // Position p = tick * CONTROL_RATE + j used the delay time (j + 1) / CONTROL_RATE of the way from that
+   // tick's value to the next's.
+   const float q = pos + 1;
+   const uint32_t tick = (uint32_t)q / CONTROL_RATE;
+   const float frac = (q - (float)(tick * CONTROL_RATE)) * (1.0f / CONTROL_RATE);
+   const float t0 = delayTimeHistory[tick & (NUM_DELAY_HISTORY - 1)];
+   const float t1 = delayTimeHistory[(tick + 1) & (NUM_DELAY_HISTORY - 1)];
+   return linintf(frac, t0, t1);
+}
+
+
+////////////////////////////////////////////////////////////////////////
+// depthAt
+// - The depth that was used when writing position 'pos' of the delay
+//   line (it only changes at control ticks, so no in between here)
+////////////////////////////////////////////////////////////////////////
+inline __attribute__((always_inline))
+float depthAt(const float pos)
+{
+   return depthHistory[((uint32_t)pos / CONTROL_RATE) & (NUM_DELAY_HISTORY - 1)];
+}
+#endif
+
+
+////////////////////////////////////////////////////////////////////////
+// processBlock
+// - Process a sub-block of frames (at most PROCESS_BLOCK_FRAMES, if DELFX_PROCESS cuts the buffer up)
+// - Built for one storage / interpolation / routing policy combination
+////////////////////////////////////////////////////////////////////////
+template <class Storage, class Interp, class Routing>
+inline __attribute__((always_inline))
+void processBlock(float * __restrict x, uint32_t frames)
+{
+   const float * x_e = x + 2*frames; // End of this sub-block's address
+
+#if TAIL_TRACKING
+   // Keep track of the loudest sample we write
+   float writePeak = 0;
+
+   // Remember where this sub-block starts writing
+   const uint32_t startWr = delayLine_Wr;
+#endif
+
+#if ENGINE_COUNTERS
+   // Counted / measured over this sub-block, added to the counters at the end
+   uint32_t glideFrames = 0;
+   uint32_t denormalHits = 0;
+   uint32_t limiterHits = 0;
+   float peakIn = 0;
+   float peakOut = 0;
+   float peakFeedback = 0;
+#endif
+
+#if TEMPO_DETECT
+   // Input level summed over this sub-block, for the tempo detection
+   float envSum = 0;
+#endif
+
+#if GRANULAR_MODE
+   // (for the headroom the grains have, see renderGrains)
+   const uint32_t blockStartCycles = readCycleCounter();
+
+   // Render the grain cloud for this sub-block up front, the grains never read the part of the
+   // delay lines we are about to write.
+   float cloud[2][PROCESS_BLOCK_FRAMES];
+   renderGrains(cloud, frames);
+   const float *pCloudL = cloud[0];
+   const float *pCloudR = cloud[1];
+#endif
+
+   // Loop through the samples - for delay effects, you replace the value at *xn with your new value
+   // This data is interleaved with left/right data
+   for (; x != x_e; ) 
+   {
+      // Time for the slow moving stuff to be updated?
+      if (controlFramesLeft == 0)
+      {
+         controlTick();
+      }
+
+      // Run up to the next control tick (or the end of the sub-block)
+      uint32_t n = (uint32_t)(x_e - x) / 2;
+      n = (n > controlFramesLeft) ? controlFramesLeft : n;
+      controlFramesLeft -= n;
+      const float * x_tick = x + 2*n;
+
+#if ENGINE_COUNTERS
+      glideFrames += (delayTimeInc != 0) ? n : 0;
+#endif
+
+#if PINGPONG_SINGLE_LINE
+      // Have the delay time and depth been steady for longer than the second read reaches back?
+      framesSinceChange = (delayTimeInc != 0) ? 0 : framesSinceChange + n;
+      const bool steady = framesSinceChange > 2 * (uint32_t)currentDelayTime + 2 * CONTROL_RATE;
+#endif
+
+      for (; x != x_tick; )
+      {
+         // Smoothly transition the delay time
+         // - The glide itself is worked out in controlTick, here we only need to step along it
+         currentDelayTime += delayTimeInc;
+
+         //Get our input signal values to the effect
+
+         float sigInL = *x; // get the value pointed at x (Left channel)
+         float sigInR = *(x+1); // get the value pointed at x + 1(right channel)
+
+#if TEMPO_DETECT
+         envSum += si_fabsf(sigInL) + si_fabsf(sigInR);
+#endif
+      
+         // Declare some storage for our output signals
+         float sigOutL;
+         float sigOutR;
+
+         // The way this delay will work, is we will continually write to the delay line
+         // with the new incoming audio directly into the delay line (per sample). 
+         // We will read 'behind' this index using a floating point value to allow us
+         // to read sub-sample values from this delay line.
+
+         // Calculate the read index (floating point so can have a fraction)
+         float readIndex = (float)delayLine_Wr - currentDelayTime;
+
+         // Since this is a float we can't just mask it to account for rollover
+         // - since we subtracted the index it could be negative - roll this value over
+         // around the delay line
+         if (readIndex < 0)
+         {
+            // Roll the pointer back to the end of the buffer (index)
+            readIndex += DELAY_LINE_SIZE;
+         }
+
+         // The right side may be read a little further back than the left (PseudoStereoRouting, for width).
+         // (for the other routings the offset is 0, and all of this goes away)
+         float readIndexR = readIndex - Routing::rightOffset;
+         if (Routing::rightOffset && (readIndexR < 0))
+         {
+            readIndexR += DELAY_LINE_SIZE;
+         }
+
+         // Ping-pong style delay:
+         // Read the delayed (behind) signal for the right channel first
+         float delayLineSig_R = Interp::template read<Storage>(readIndexR, delayLine_R, DELAY_LINE_SIZE_MASK);
+
+#if PINGPONG_SINGLE_LINE
+         // Single line:
+         // What the left delay line would have held here is the right delay line's signal from one
+         // more delay time back (the delay time at that time), times the depth (also at that time).
+         float readIndex2 = readIndex - (steady ? currentDelayTime : delayTimeAt(readIndex));
+         if (readIndex2 < 0)
+         {
+            readIndex2 += DELAY_LINE_SIZE;
+         }
+         const float depthL = steady ? valDepth : depthAt(readIndex);
+         float delayLineSig_L = depthL * Interp::template read<Storage>(readIndex2, delayLine_R, DELAY_LINE_SIZE_MASK);
+
+#if WRITE_PEAKS
+         // (not written anywhere, only for the tail tracking and meters - it's all repeats)
+         const float writeL = delayLineSig_R * valDepth;
+#endif
+#if ENGINE_COUNTERS
+         const float backL = writeL;
+#endif
+
+         float feedbackL = delayLineSig_L;
+#if DENORMAL_GUARD
+#if ENGINE_COUNTERS
+         const bool tinyR = false; // (nothing is flushed on the right, this is only for the counters)
+#endif
+         const bool tinyL = (si_fabsf(feedbackL) < DENORMAL_LEVEL) && (feedbackL != 0);
+         feedbackL = tinyL ? 0 : feedbackL;
+#endif
+
+         // Write the right channel input signal into the right channel buffer, *added* (mixed) with this
+         // left delayed signal (multiplied by feedback)
+         // - that is, effectively mix this left delayed signal with the right input signal 
+         const float backR = feedbackL * valDepth;
+         const float writeR = sigInR + backR;
+#else
+         // The signal we feed across to the other side (the delayed signal, plus any processing of the repeats)
+         float feedbackR = delayLineSig_R;
+#if SHIMMER_MODE
+         feedbackR = shimmerProcess(&shimmer_R, feedbackR);
+#endif
+#if LOFI_MODE
+         feedbackR = lofiProcess(&lofi_R, feedbackR);
+#endif
+#if DENORMAL_GUARD
+         // (no branch, this is a compare and select)
+         const bool tinyR = (si_fabsf(feedbackR) < DENORMAL_LEVEL) && (feedbackR != 0);
+         feedbackR = tinyR ? 0 : feedbackR;
+#endif
+
+         // Read the delayed (behind) signal for the left channel
+         // (the read position is always a long way behind where we are about to write, so it doesn't
+         // matter that we read it before writing the new left sample)
+         float delayLineSig_L = Interp::template read<Storage>(readIndex, delayLine_L, DELAY_LINE_SIZE_MASK);
+
+         float feedbackL = delayLineSig_L;
+#if SHIMMER_MODE
+         feedbackL = shimmerProcess(&shimmer_L, feedbackL);
+#endif
+#if LOFI_MODE
+         feedbackL = lofiProcess(&lofi_L, feedbackL);
+#endif
+#if DENORMAL_GUARD
+         const bool tinyL = (si_fabsf(feedbackL) < DENORMAL_LEVEL) && (feedbackL != 0);
+         feedbackL = tinyL ? 0 : feedbackL;
+#endif
+
+         // Where the input and the repeats go is up to the routing (see Routing policies)
+         float writeL;
+         float writeR;
+         float backL;
+         float backR;
+         Routing::route(sigInL, sigInR, feedbackL, feedbackR, writeL, writeR, backL, backR);
+         delayLine_L[delayLine_Wr] = Storage::store(writeL);
+
+#endif
+
+         delayLine_R[delayLine_Wr] = Storage::store(writeR);
+
+#if WRITE_PEAKS
+         // How loud what we have just written to either delay line is
+         const float absL = si_fabsf(writeL);
+         const float absR = si_fabsf(writeR);
+#if TAIL_TRACKING
+         // Track the loudest sample we have written
+         writePeak = (absL > writePeak) ? absL : writePeak;
+         writePeak = (absR > writePeak) ? absR : writePeak;
+#endif
+#endif
+
+#if ENGINE_COUNTERS
+         // Level meters (these are all selects, not branches)
+         const float absIn = (si_fabsf(sigInL) > si_fabsf(sigInR)) ? si_fabsf(sigInL) : si_fabsf(sigInR);
+         const float absFeedback = (si_fabsf(backL) > si_fabsf(backR)) ? si_fabsf(backL) : si_fabsf(backR);
+         peakIn = (absIn > peakIn) ? absIn : peakIn;
+         peakFeedback = (absFeedback > peakFeedback) ? absFeedback : peakFeedback;
+
+         // Anything written past full scale gets clipped (16 bit storage), or soon will be somewhere down the line
+         limiterHits += (absL > 1.0f) | (absR > 1.0f);
+#if DENORMAL_GUARD
+         denormalHits += tinyL + tinyR;
+#endif
+#endif
+
+         // Increment and roll over our write index for the delay line 
+         // This is an integer, and a power of 2 so we can simply mask the value by the DELAY_LINE_SIZE_MASK.
+         delayLine_Wr++;
+         delayLine_Wr &= DELAY_LINE_SIZE_MASK; 
+
+    
+#if GRANULAR_MODE
+         // Cloud mode - the wet signal is the grain cloud instead of the delayed signal
+         sigOutL = sigInL * dry + *pCloudL++ * wet;
+         sigOutR = sigInR * dry + *pCloudR++ * wet;
+#else
+         // Generate our output signal:
+         // That is, the input signal * the dry level + (mixed with) the delayed signal * the wet level.
+         sigOutL = sigInL * dry + delayLineSig_L * wet;
+
+         // And again for the right channel
+         sigOutR = sigInR * dry + delayLineSig_R * wet;
+#endif
+
+#if ENGINE_COUNTERS
+         const float absOut = (si_fabsf(sigOutL) > si_fabsf(sigOutR)) ? si_fabsf(sigOutL) : si_fabsf(sigOutR);
+         peakOut = (absOut > peakOut) ? absOut : peakOut;
+#endif
+
+         // Store this result into the output buffer
+         *x = sigOutL;
+
+         // Move to the next channel
+         x++;
+
+         // Store this result into the output buffer
+         *x = sigOutR; 
+
+         // Move to the next interleaved sample
+         x++;		
+      }
+   }
+
+#if TEMPO_DETECT
+   tempoProcess(envSum, frames);
+#endif
+
+#if GRANULAR_MODE
+   // Everything this sub-block took apart from the grains is what the grains have to leave room for
+   const float rest = (float)(readCycleCounter() - blockStartCycles - grainCycles) / frames;
+   restCost += (rest - restCost) * 0.05f;
+#endif
+
+#if ENGINE_COUNTERS
+   countersLive.glideFrames += glideFrames;
+   countersLive.denormalHits += denormalHits;
+   countersLive.limiterHits += limiterHits;
+
+   countersLive.peakIn = (peakIn > countersLive.peakIn) ? peakIn : countersLive.peakIn;
+   countersLive.peakOut = (peakOut > countersLive.peakOut) ? peakOut : countersLive.peakOut;
+   countersLive.peakFeedback = (peakFeedback > countersLive.peakFeedback) ? peakFeedback : countersLive.peakFeedback;
+#endif
+
+#if ENGINE_TRACE
+   tracePeakIn = (peakIn > tracePeakIn) ? peakIn : tracePeakIn;
+   tracePeakOut = (peakOut > tracePeakOut) ? peakOut : tracePeakOut;
+#endif
+
+#if TAIL_TRACKING
+   // Store the peak of this sub-block into the tail slot(s) it wrote to. A sub-block is never longer
+   // than a slot, so it touches at most two. Entering a new slot means the data it covered last time around
+   // has just been overwritten, so that slot starts over from this peak.
+   const uint32_t firstSlot = startWr >> TAIL_SLOT_SHIFT;
+   const uint32_t lastSlot = ((delayLine_Wr - 1) & DELAY_LINE_SIZE_MASK) >> TAIL_SLOT_SHIFT;
+   if (firstSlot != tailCurrentSlot)
+   {
+      tailSlotPeak[firstSlot] = writePeak;
+   }
+   else
+   {
+      tailSlotPeak[firstSlot] = (writePeak > tailSlotPeak[firstSlot]) ? writePeak : tailSlotPeak[firstSlot];
+   }
+   if (lastSlot != firstSlot)
+   {
+      tailSlotPeak[lastSlot] = writePeak;
+   }
+   tailCurrentSlot = lastSlot;
+#endif
+}
+
+
+#if ENGINE_COUNTERS
+////////////////////////////////////////////////////////////////////////
+// publishCounters
+// - Hand a copy of the counters over to getCounters() (once per buffer)
+////////////////////////////////////////////////////////////////////////
+inline __attribute__((always_inline))
+void publishCounters()
+{
+   // Odd = being written
+   const uint32_t seq = countersSeq;
+   __atomic_store_n(&countersSeq, seq + 1, __ATOMIC_RELAXED);
+   __atomic_thread_fence(__ATOMIC_RELEASE);
+
+   countersPublished = countersLive;
+
+   // Even again = done
+   __atomic_store_n(&countersSeq, seq + 2, __ATOMIC_RELEASE);
+
+   // Start the peaks over if someone asked us to
+   if (__atomic_load_n(&countersResetPeaks, __ATOMIC_ACQUIRE))
+   {
+      countersLive.peakIn = 0;
+      countersLive.peakOut = 0;
+      countersLive.peakFeedback = 0;
+      __atomic_store_n(&countersResetPeaks, 0, __ATOMIC_RELAXED);
+   }
+}
+#endif
+
+
+#if ENGINE_TRACE
+////////////////////////////////////////////////////////////////////////
+// traceBuffer
+// - Add an entry for the buffer we just processed to the trace
+////////////////////////////////////////////////////////////////////////
+inline __attribute__((always_inline))
+void traceBuffer(uint32_t frames, float bpm, uint32_t cycles)
+{
+   const uint32_t n = traceWr;
+   trace_entry_t *e = &traceRing[n & TRACE_MASK];
+
+   e->buffer = n;
+   e->frame = countersLive.frames - frames;
+   e->frames = frames;
+   e->cycles = cycles;
+   e->bpm = bpm;
+   e->targetDelayTime = targetDelayTime;
+   e->currentDelayTime = currentDelayTime;
+   e->depth = valDepth;
+   e->wet = wet;
+   e->dry = dry;
+   e->peakIn = tracePeakIn;
+   e->peakOut = tracePeakOut;
+   tracePeakIn = 0;
+   tracePeakOut = 0;
+
+   // Only count it once it's all there, so a reader never sees half an entry
+   __atomic_store_n(&traceWr, n + 1, __ATOMIC_RELEASE);
+}
+#endif
+
+
 ////////////////////////////////////////////////////////////////////////
 // DELFX_PROCESS
 // - Called for every buffer , process your samples here
@@ -141,7 +1783,11 @@ void DELFX_PROCESS(float *xn, uint32_t frames)
 {
 
    float * __restrict x = xn; // Local pointer, pointer xn copied here. 
-   const float * x_e = x + 2*frames; // End of data buffer address
+
+#if ENGINE_TRACE
+   const uint32_t startCycles = readCycleCounter();
+   const uint32_t bufferFrames = frames;
+#endif
 
 
    // *Any code here will be called ONCE per buffer. Typically there are 16 samples per buffer,
@@ -151,6 +1797,32 @@ void DELFX_PROCESS(float *xn, uint32_t frames)
    // while processing samples, saves some cpu time.)
    float bpmF = fx_get_bpmf(); //this is the bpm, in minutes
 
+#if PRESET_BANK
+   // Switch presets if the host asked us to (only ever between buffers)
+   preset_t *preset = __atomic_exchange_n(&pendingPreset, (preset_t *)NULL, __ATOMIC_ACQUIRE);
+   if (preset)
+   {
+      applyPreset(preset);
+   }
+#endif
+
+#if MIDSIDE_FEEDBACK
+   // Same for a new feedback width
+   float *width = __atomic_exchange_n(&pendingWidth, (float *)NULL, __ATOMIC_ACQUIRE);
+   if (width)
+   {
+      feedbackWidth = *width;
+      updateMidSide();
+   }
+#endif
+
+#if TEMPO_DETECT
+   // No tempo clock? Use the tempo we detected from the input instead (if we have found one yet)
+   if (bpmF <= 0)
+   {
+      bpmF = detectedBpm;
+   }
+#endif
 
    // Failsafe - since we are going to divide by bpmF it can never be zero. 
    // It never is, but a good idea in my opinion to make sure.
@@ -160,104 +1832,302 @@ void DELFX_PROCESS(float *xn, uint32_t frames)
       bpmF = MIN_BPM;
    }
 
-   
-   //Calculate the # of beats per second 
-   float bpm_s = 60 / bpmF;
 
    // Calculate our delay time (as a float) by taking:
-   //   The # of samples per second * the # of beats per second * the number of notes per second * our multiplier.
+   //   The # of samples per second * the # of beats per second (60 / bpm) * the number of notes per second * our multiplier.
    //   note, the multiplier is 1 or lower, so this will result in a reduction only.
-   targetDelayTime = SAMPLE_RATE * bpm_s * NUM_NOTES_PER_BEAT * multiplier;
+   // Everything but the bpm was multiplied together into delayFactor when the time knob changed.
+   const float newDelayTime = delayFactor / bpmF;
+
+#if ENGINE_COUNTERS
+   // A new target means a new glide (tempo or time knob change)
+   countersLive.retriggers += (newDelayTime != targetDelayTime) ? 1 : 0;
+   countersLive.buffers++;
+   countersLive.frames += frames;
+#endif
+   targetDelayTime = newDelayTime;
           
-   // Loop through the samples - for delay effects, you replace the value at *xn with your new value
-   // This data is interleaved with left/right data
-   for (; x != x_e; ) 
+   // Process the buffer in sub-blocks. On the NTS-1 this is always 16 frames (a single sub-block),
+   // but a host may hand us thousands of frames at a time. The grain cloud is rendered into a
+   // PROCESS_BLOCK_FRAMES buffer, and the tail tracking needs a sub-block to fit in a tail slot,
+   // so those need the buffer cut up. Otherwise it is all done in one go.
+   while (frames)
    {
-      // Smoothly transition the delay time
-      // - This gives the same effect as exponential 'glide'
+#if GRANULAR_MODE || TAIL_TRACKING
+      const uint32_t n = (frames > PROCESS_BLOCK_FRAMES) ? PROCESS_BLOCK_FRAMES : frames;
+#else
+      const uint32_t n = frames;
+#endif
+      processBlock<DelayStorage, DelayInterp, DelayRouting>(x, n);
+
+      // Move on to the next sub-block (2 samples per frame, interleaved)
+      x += 2*n;
+      frames -= n;
+   }
 
-      // Calculate the difference between the target and the current delay time
-      float delta = targetDelayTime - currentDelayTime;
+#if ENGINE_TRACE
+   traceBuffer(bufferFrames, bpmF, readCycleCounter() - startCycles);
+#endif
 
-      // Divide this by the glide rate (larger glide rates = longer glide times.)
-      // Glide rate cannot be lower than 1!
-      delta /= DELAY_GLIDE_RATE;
+#if ENGINE_COUNTERS
+   publishCounters();
+#endif
+}
 
-      // Add to our current delay time this delta. 
-      currentDelayTime += delta;   
 
-      //Get our input signal values to the effect
 
-      float sigInL = *x; // get the value pointed at x (Left channel)
-      float sigInR = *(x+1); // get the value pointed at x + 1(right channel)
-      
-      // Declare some storage for our output signals
-      float sigOutL;
-      float sigOutR;
-
-      // The way this delay will work, is we will continually write to the delay line
-      // with the new incoming audio directly into the delay line (per sample). 
-      // We will read 'behind' this index using a floating point value to allow us
-      // to read sub-sample values from this delay line.
-
-      // Calculate the read index (floating point so can have a fraction)
-      float readIndex = (float)delayLine_Wr - currentDelayTime;
-
-      // Since this is a float we can't just mask it to account for rollover
-      // - since we subtracted the index it could be negative - roll this value over
-      // around the delay line
-      if (readIndex < 0)
-      {
-         // Roll the pointer back to the end of the buffer (index)
-         readIndex += DELAY_LINE_SIZE_MASK;
-      }
+#if TAIL_TRACKING
+////////////////////////////////////////////////////////////////////////
+// getTailLevel
+// - Peak level (linear) of everything in the delay lines that will
+//   still be heard. Not used on the unit itself, this is for a host
+//   rendering offline to know when the repeats have died out.
+////////////////////////////////////////////////////////////////////////
+float getTailLevel()
+{
+   // Everything older than the (current) delay time has already been read back out - and either went
+   // to the output, or was fed back into the delay lines (which we will also see). So we only have to look at
+   // the slots holding the last delay time's worth of writes, +1 slot for the slot we are part way through.
+#if PINGPONG_SINGLE_LINE
+   // (the single line is read two delay times back)
+   const uint32_t numSlots = ((2 * (uint32_t)currentDelayTime) >> TAIL_SLOT_SHIFT) + 2;
+#elif GRANULAR_MODE
+   // (the grains read up to GRAIN_SPREAD further back than the delay time, and a grain length more
+   // for grains started while the delay time was still gliding down)
+   const uint32_t numSlots = (((uint32_t)(currentDelayTime * (1.0f + GRAIN_SPREAD)) + GRAIN_LENGTH) >> TAIL_SLOT_SHIFT) + 2;
+#else
+   // (plus however much further back the right side is read, for the routings that offset it)
+   const uint32_t numSlots = (((uint32_t)currentDelayTime + DelayRouting::rightOffset) >> TAIL_SLOT_SHIFT) + 2;
+#endif
+
+   float level = 0;
+   uint32_t slot = tailCurrentSlot;
+   for (uint32_t i = 0; i < numSlots; i++)
+   {
+      level = (tailSlotPeak[slot] > level) ? tailSlotPeak[slot] : level;
 
-      // Ping-pong style delay:
-      // Read the delayed (behind) signal for the right channel first
-      float delayLineSig_R = readFrac(readIndex, delayLine_R);
+      // Walk backwards through the slots, rolling over just like the delay line itself
+      slot = (slot - 1) & (NUM_TAIL_SLOTS - 1);
+   }
+   return level;
+}
 
-      // Write the right channel input signal into the right channel buffer
-      delayLine_R[delayLine_Wr] = sigInR;
 
-      // Store the delayed right channel signal - multiplied by the feedback value (0-1) into the left channel
-      delayLine_L[delayLine_Wr] = delayLineSig_R * valDepth; //tbd on the valdepth
+////////////////////////////////////////////////////////////////////////
+// isTailSilent
+// - True once the tail has decayed below thresholdDb (e.g. -96dB)
+////////////////////////////////////////////////////////////////////////
+bool isTailSilent(float thresholdDb)
+{
+   // dB to linear: 10^(dB/20) = 2^(dB/6.0206)
+   return getTailLevel() < fastpow2f(thresholdDb * (1.0f / 6.0206f));
+}
+#endif
 
-      // Read the delayed (behind) signal for the left channel
-      float delayLineSig_L = readFrac(readIndex, delayLine_L);
 
-      // *Add* (mix) this signal with the existing signal at the right channel delay line (multiplied by feedback)
-      // - that is, effectively mix this left delayed signal with the right input signal 
-      delayLine_R[delayLine_Wr] += delayLineSig_L * valDepth;
+////////////////////////////////////////////////////////////////////////
+// getPredictedTailFrames
+// - How many frames after the input goes silent until the repeats have
+//   decayed below thresholdDb, from the current depth and delay time.
+//   Returns 0xFFFFFFFF if the repeats never decay (depth at full).
+////////////////////////////////////////////////////////////////////////
+uint32_t getPredictedTailFrames(float thresholdDb)
+{
+   // How much the level drops every delay time
+#if MIDSIDE_FEEDBACK
+   // (the mid and side parts die away separately, the tail lasts as long as the slower one)
+   const float loopGain = (fbCross + fbSame > fbCross - fbSame) ? fbCross + fbSame : fbCross - fbSame;
+#else
+   const float loopGain = valDepth;
+#endif
+
+   // With no feedback at all, there is exactly one repeat (one delay time later)
+   if (loopGain <= 0)
+   {
+      return (uint32_t)targetDelayTime + DelayRouting::rightOffset;
+   }
 
-      // Increment and roll over our write index for the delay line 
-      // This is an integer, and a power of 2 so we can simply mask the value by the DELAY_LINE_SIZE_MASK.
-      delayLine_Wr++;
-      delayLine_Wr &= DELAY_LINE_SIZE_MASK; 
+   // With full feedback, the repeats never die out.
+   if (loopGain >= 1.0f)
+   {
+      return 0xFFFFFFFF;
+   }
 
-    
-      // Generate our output signal:
-      // That is, the input signal * the dry level + (mixed with) the delayed signal * the wet level.
-      sigOutL = sigInL * dry + delayLineSig_L * wet;
+   // Each trip around the loop (one delay time, as we bounce from side to side) multiplies the level by
+   // the depth, so after n extra repeats the level is depth^n. Solve depth^n = threshold for n:
+   //   n = log(threshold) / log(depth) = (thresholdDb / 6.0206) / log2(depth)
+   const float repeats = (thresholdDb * (1.0f / 6.0206f)) / fastlog2f(loopGain);
+
+   // +1 for the first repeat (which is at full level), +1 to round up
+   // (and the right side may be read a little later than the left, see the routing policies)
+   return (uint32_t)((repeats + 2) * targetDelayTime) + DelayRouting::rightOffset;
+}
+
+
+#if ENGINE_COUNTERS
+////////////////////////////////////////////////////////////////////////
+// getCounters
+// - Copy the counters as of the end of the last buffer. Safe to call
+//   from any thread while audio is running, never blocks the audio.
+////////////////////////////////////////////////////////////////////////
+void getCounters(counters_t *out)
+{
+   uint32_t before;
+   uint32_t after;
+   do
+   {
+      // If the audio code is half way through handing over a copy (odd), or does so while we copy it
+      // (changed), try again.
+      before = __atomic_load_n(&countersSeq, __ATOMIC_ACQUIRE);
+      *out = countersPublished;
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      after = __atomic_load_n(&countersSeq, __ATOMIC_RELAXED);
+   } while ((before & 1) || (before != after));
+}
+
+
+////////////////////////////////////////////////////////////////////////
+// resetCounterPeaks
+// - Start the peak levels over (from the end of the next buffer)
+////////////////////////////////////////////////////////////////////////
+void resetCounterPeaks()
+{
+   __atomic_store_n(&countersResetPeaks, 1, __ATOMIC_RELEASE);
+}
+#endif
 
-      // And again for the right channel
-      sigOutR = sigInR * dry + delayLineSig_R * wet;
 
-      // Store this result into the output buffer
-      *x = sigOutL;
+////////////////////////////////////////////////////////////////////////
+// isMemoryLocked
+// - True if DELFX_INIT locked all of the delay memory into RAM
+////////////////////////////////////////////////////////////////////////
+bool isMemoryLocked()
+{
+   return memoryLocked;
+}
 
-      // Move to the next channel
-      x++;
 
-      // Store this result into the output buffer
-      *x = sigOutR; 
+#if PRESET_BANK
+////////////////////////////////////////////////////////////////////////
+// loadPreset
+// - Store knob settings (0-1 each) in a preset slot, working out
+//   everything needed to switch to it now rather than when switching.
+//   (with MIDSIDE_FEEDBACK, the width last set by setFeedbackWidth()
+//   is stored as well). Don't load a slot that is about to be switched to.
+////////////////////////////////////////////////////////////////////////
+bool loadPreset(uint32_t slot, float time, float depth, float mix)
+{
+   if (slot >= NUM_PRESETS)
+   {
+      return false;
+   }
+
+   preset_t *p = &presetBank[slot];
+   p->valTime = time;
+   p->valDepth = depth;
+   p->valMix = mix;
+   p->multiplier = timeKnobToMultiplier(time);
+   p->delayFactor = SAMPLE_RATE * 60 * NUM_NOTES_PER_BEAT * p->multiplier;
+   p->wet = mixKnobToWet(mix);
+   p->dry = 1.0f - p->wet;
+#if MIDSIDE_FEEDBACK
+   // (requestedWidth, not feedbackWidth - that one belongs to the audio code)
+   p->feedbackWidth = requestedWidth;
+   midSideAmounts(depth, p->feedbackWidth, &p->fbCross, &p->fbSame);
+#endif
+   return true;
+}
+
 
-      // Move to the next interleaved sample
-      x++;		
+////////////////////////////////////////////////////////////////////////
+// selectPreset
+// - Switch to a preset slot at the start of the next buffer
+////////////////////////////////////////////////////////////////////////
+bool selectPreset(uint32_t slot)
+{
+   if (slot >= NUM_PRESETS)
+   {
+      return false;
    }
-   
+
+   __atomic_store_n(&pendingPreset, &presetBank[slot], __ATOMIC_RELEASE);
+   return true;
+}
+#endif
+
+
+#if MIDSIDE_FEEDBACK
+////////////////////////////////////////////////////////////////////////
+// setFeedbackWidth
+// - Set the side depth of the feedback, as a multiple of the depth
+//   knob (mid depth). Below 1 narrows the repeats, above 1 widens them.
+//   Takes effect at the start of the next buffer.
+////////////////////////////////////////////////////////////////////////
+void setFeedbackWidth(float width)
+{
+   requestedWidth = (width > 0) ? width : 0;
+   __atomic_store_n(&pendingWidth, &requestedWidth, __ATOMIC_RELEASE);
 }
+#endif
 
 
+#if ENGINE_TRACE
+////////////////////////////////////////////////////////////////////////
+// getTrace
+// - Copy (up to) the last maxEntries buffers of the trace into out,
+//   oldest first. Returns how many were copied. Safe to call from any
+//   thread while audio is running, never blocks the audio.
+//   At most TRACE_LENGTH - 1 - the oldest slot is where the next buffer's
+//   entry goes, so it may be being overwritten as we copy it.
+////////////////////////////////////////////////////////////////////////
+uint32_t getTrace(trace_entry_t *out, uint32_t maxEntries)
+{
+   const uint32_t end = __atomic_load_n(&traceWr, __ATOMIC_ACQUIRE);
+   uint32_t count = (end < maxEntries) ? end : maxEntries;
+   count = (count < TRACE_LENGTH - 1) ? count : TRACE_LENGTH - 1;
+   uint32_t start = end - count;
+
+   for (uint32_t i=0;i<count;i++)
+   {
+      out[i] = traceRing[(start + i) & TRACE_MASK];
+   }
+
+   // The audio may have carried on writing while we copied. Anything it may have (started to) overwrite
+   // is dropped from the front - the entry being written now is in the slot of entry nowWr - TRACE_LENGTH.
+   // (if it hasn't moved on, that's the slot before start and nothing is dropped)
+   __atomic_thread_fence(__ATOMIC_ACQUIRE);
+   const uint32_t nowWr = __atomic_load_n(&traceWr, __ATOMIC_RELAXED);
+   const uint32_t firstGood = nowWr + 1 - TRACE_LENGTH;
+   if ((int32_t)(firstGood - start) > 0)
+   {
+      const uint32_t dropped = ((firstGood - start) < count) ? (firstGood - start) : count;
+      count -= dropped;
+      for (uint32_t i=0;i<count;i++)
+      {
+         out[i] = out[i + dropped];
+      }
+   }
+   return count;
+}
+#endif
+
+
+#if TEMPO_DETECT
+////////////////////////////////////////////////////////////////////////
+// getDetectedTempo
+// - The tempo detected from the input (0 if none yet), and how
+//   confident the detection is (0-1)
+////////////////////////////////////////////////////////////////////////
+float getDetectedTempo(float *confidence)
+{
+   if (confidence)
+   {
+      *confidence = detectedConfidence;
+   }
+   return detectedBpm;
+}
+#endif
+
 
 ////////////////////////////////////////////////////////////////////////////////////
 //		PARAM
@@ -283,9 +2153,6 @@ void DELFX_PARAM(uint8_t index, int32_t value)
    // need to declare them here, the compiler may throw an error if you try to declare
    // it within the case statements etc. 
    const float valf = q31_to_f32(value);
-   float f; // Temp value used for calculations
-   float s_mix; // Used for wet/dry calculations
-   int divIndex; // Integer value for delay time multiplier (division really as the value is 1 or <1) table index
    // Select which parameter to work with:
    switch (index) 
    {
@@ -298,21 +2165,9 @@ void DELFX_PARAM(uint8_t index, int32_t value)
          //Store this 0-1 value in case we need it for something else (currently we do not)
          valTime = valf;
 
-         // Convert the 0-1 value into an array index (e.g. there are 15 divisions, so we need an index value from 0-14)         
-         f = valf;
-         f *= NUM_DELAY_DIVISIONS - 1; //0-14 15 delay divisions
-
-         // Set an integer value for our table index
-         divIndex = (int)f;
-         
-         // Failsafe, ensure it is within a valid range (it always is though)
-         if ((divIndex >= NUM_DELAY_DIVISIONS) || (divIndex < 0))
-         {
-            divIndex = NUM_DELAY_DIVISIONS - 1;//failsafe
-         }
-
-         // Get the time multiplier from the division table.
-         multiplier = delayDivisions[divIndex];
+         // Get the time multiplier from the division table, and work out what the bpm is divided into for the delay time
+         multiplier = timeKnobToMultiplier(valf);
+         delayFactor = SAMPLE_RATE * 60 * NUM_NOTES_PER_BEAT * multiplier;
          break;
 
       case k_user_delfx_param_depth:      
@@ -322,6 +2177,9 @@ void DELFX_PARAM(uint8_t index, int32_t value)
          // Set the delay feedback (0-1, tbd if i use an exp table)   
          // Just store this value for the DSP loop to use.
          valDepth = valf;
+#if MIDSIDE_FEEDBACK
+         updateMidSide();
+#endif
          break;
 
       case k_user_delfx_param_shift_depth:         
@@ -329,33 +2187,11 @@ void DELFX_PARAM(uint8_t index, int32_t value)
          // "DELAY+B" / SHIFT-DEPTH KNOB
          ////////////////////////////////
          // For delays this is wet/dry, though you can technically use this 3rd parameter for whatever you want!
-         //Left side of the knob (all dry to full mix)
-         // Adapted from the korg example, this allows us to get a 50/50 split at full mix but a higher level for
-         // full wet / full dry. 
-
-         // I've expanded the korg example here to make it a bit easier to follow
-         //s_mix = (valf <= 0.49f) ? 1.02040816326530612244f * valf : (valf >= 0.51f) ? 0.5f + 1.02f * (valf-0.51f) : 0.5f;    
-         
-         // Are we at the left half of the knob position?
-         if (valf <= 0.49f)
-         {
-            // Yes, amplify the mix value slightly
-            s_mix = 1.02040816326530612244f * valf;
-         }
-         // No, are we at the right half of the knob position?
-         else if (valf >= 0.51f) 
-         {
-            // Yes, amplify the mix value but also invert it and subtract the 0.51 offset from it (so the mix value will decrease when turning the knob higher)
-            s_mix = 0.5f + 1.02f * (valf-0.51f);
-         }
-         else
-         {
-            // Midpoint, set the mix value to 50%
-            s_mix =  0.5f; 
-         }
+         valMix = valf;
+
          // Calculate our wet / dry values
-         dry = 1.0f - s_mix; 
-         wet = s_mix;         
+         wet = mixKnobToWet(valf);
+         dry = 1.0f - wet; 
          break;
 
       default:
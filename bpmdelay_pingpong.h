@@ -0,0 +1,101 @@
+/*
+ * File: bpmdelay_pingpong.h
+ *
+ * Extra (non DELFX_*) calls into the delay, for use by a host running this
+ * effect outside of the NTS-1 - e.g. rendering audio offline.
+ * None of these are needed (or called) on the NTS-1 itself.
+ *
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+// Runtime counters (ENGINE_COUNTERS=1 builds, the default on a pc)
+typedef struct
+{
+   uint32_t buffers;       // # of DELFX_PROCESS calls
+   uint32_t frames;        // # of frames processed
+   uint32_t glideFrames;   // # of frames processed while the delay time was gliding
+   uint32_t retriggers;    // # of times the target delay time changed (tempo or time knob)
+   uint32_t limiterHits;   // # of frames that wrote past full scale into the delay lines
+   uint32_t denormalHits;  // # of feedback samples flushed to zero by the denormal guard
+   float peakIn;           // Peak input level since the last resetCounterPeaks()
+   float peakOut;          // Peak output level
+   float peakFeedback;     // Peak level of the repeats fed back into the delay lines (not counting the input)
+   const char *variant;    // What this build was built with, e.g. "FloatStorage/LinearInterp/PingPongRouting"
+} counters_t;
+
+// - Copy of the counters as of the end of the last buffer. Never blocks
+//   (or is blocked by) the audio, can be called from any thread.
+void getCounters(counters_t *out);
+
+// - Start the peak levels over, from the end of the next buffer
+void resetCounterPeaks();
+
+// Trace (ENGINE_TRACE=1 builds only)
+// One entry per DELFX_PROCESS call, the last TRACE_LENGTH (default 4096) are kept
+typedef struct
+{
+   uint32_t buffer;           // # of this buffer since DELFX_INIT (0, 1, 2...)
+   uint32_t frame;            // # of frames processed before this buffer (the buffer's position in time)
+   uint32_t frames;           // # of frames in this buffer
+   uint32_t cycles;           // cpu cycles DELFX_PROCESS took (the time stamp counter on a pc)
+   float bpm;                 // Tempo used for this buffer
+   float targetDelayTime;     // Delay time (in samples) being glided to
+   float currentDelayTime;    // Delay time (in samples) at the end of the buffer
+   float depth;               // Depth (feedback) 0-1
+   float wet;                 // Wet level
+   float dry;                 // Dry level
+   float peakIn;              // Peak input level in this buffer
+   float peakOut;             // Peak output level in this buffer
+} trace_entry_t;
+
+// - Copy (up to) the last maxEntries buffers into out, oldest first.
+//   Returns the # of entries copied - at most TRACE_LENGTH - 1, the oldest
+//   one kept is where the next buffer's entry is written. Never blocks (or is
+//   blocked by) the audio, can be called from any thread.
+uint32_t getTrace(trace_entry_t *out, uint32_t maxEntries);
+
+// Tail tracking (TAIL_TRACKING=1 builds, the default on a pc)
+// - Peak level (linear) of what is left in the delay lines to be heard
+float getTailLevel();
+
+// - True once that level is below thresholdDb (e.g. -96.0f)
+bool isTailSilent(float thresholdDb);
+
+// - Predicted # of frames for the repeats to decay below thresholdDb
+//   once the input is silent, from the depth and delay time.
+//   (worked out from the settings, so this one is in every build)
+//   0xFFFFFFFF if they will never decay (depth at full)
+uint32_t getPredictedTailFrames(float thresholdDb);
+
+// Memory
+// - True if DELFX_INIT managed to lock the delay lines (and other big buffers)
+//   into RAM (LOCK_DELAY_MEMORY=1, the default on linux / mac). If not (e.g.
+//   RLIMIT_MEMLOCK is too low) they still work, they just might get paged out.
+//   DELFX_PROCESS and DELFX_PARAM never allocate memory or take a lock.
+bool isMemoryLocked();
+
+// Preset bank (PRESET_BANK=1 builds, the default on a pc - NUM_PRESETS slots, default 16)
+// - Store knob settings (each 0-1, as the knobs go) in a slot. Everything the
+//   delay needs from them is worked out now, so switching costs nothing.
+//   MIDSIDE_FEEDBACK builds also store the width last set with setFeedbackWidth().
+//   Returns false if there is no such slot.
+bool loadPreset(uint32_t slot, float time, float depth, float mix);
+
+// - Switch to the preset in a slot at the start of the next buffer. Don't
+//   load new settings into that slot until the switch has happened.
+bool selectPreset(uint32_t slot);
+
+// Mid/side feedback (MIDSIDE_FEEDBACK=1 builds only)
+// - Side depth as a multiple of the depth knob (the mid depth):
+//   0 = the repeats end up mono, 1 = plain ping-pong, >1 = wider
+//   (the side depth itself never goes past 1). Takes effect at the start
+//   of the next buffer.
+void setFeedbackWidth(float width);
+
+// Tempo detection (TEMPO_DETECT=1 builds only)
+// - The tempo detected from the input when there is no tempo clock,
+//   0 if none has been found yet. confidence (0-1) may be NULL.
+float getDetectedTempo(float *confidence);
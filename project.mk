@@ -15,3 +15,28 @@ UDEFS =
 ULIB = 
 
 ULIBDIR =
+
+# #############################################################################
+# Variants
+# 'make variants' builds each of these from the same source, with the extra
+# defines below added to UDEFS, and packages it as $(PROJECT)_<variant>.ntkdigunit
+# (shown on the unit with its own name, max 13 characters)
+# #############################################################################
+
+VARIANTS = lean hifi cloud shimmer
+
+# 16 bit delay lines - half the memory and memory traffic
+VARIANT_lean_DEFS = -DDELAY_STORAGE=Q15Storage
+VARIANT_lean_NAME = bpm pp lean
+
+# Cubic (hermite) interpolation
+VARIANT_hifi_DEFS = -DDELAY_INTERP=HermiteInterp
+VARIANT_hifi_NAME = bpm pp hifi
+
+# Granular cloud
+VARIANT_cloud_DEFS = -DGRANULAR_MODE=1
+VARIANT_cloud_NAME = bpm pp cloud
+
+# Octave up shimmer
+VARIANT_shimmer_DEFS = -DSHIMMER_MODE=1
+VARIANT_shimmer_NAME = bpm pp shimr